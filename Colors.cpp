@@ -1,4 +1,5 @@
 #include "Colors.h"
+#include "Settings.h"
 
 Colors colors;
 
@@ -18,8 +19,8 @@ void Colors::init(Display* display_in)
 
 	display = display_in;
 	int screen = XDefaultScreen(display);
-	Visual* visual = XDefaultVisual(display, screen);
-	Colormap colormap = XDefaultColormap(display, screen);
+	visual = XDefaultVisual(display, screen);
+	colormap = XDefaultColormap(display, screen);
 	XRenderColor render_color;
 	render_color.alpha = 0xFFFF;
 
@@ -60,6 +61,27 @@ void Colors::init(Display* display_in)
 			&render_color, &indexed_colors[i]);
 		}
 
+	// True colors.
+	is_true_color_visual = (visual->c_class == TrueColor);
+	if (is_true_color_visual) {
+		red_channel.set_mask(visual->red_mask);
+		green_channel.set_mask(visual->green_mask);
+		blue_channel.set_mask(visual->blue_mask);
+		}
+	else {
+		size_t table_size = 1;
+		for (true_color_table_bits = 0; table_size < 2 * settings.true_color_cache_size; ++true_color_table_bits)
+			table_size <<= 1;
+		if (true_color_table_bits == 0) {
+			// Need at least one slot in the table.
+			true_color_table_bits = 1;
+			table_size = 2;
+			}
+		true_color_table.assign(table_size, -1);
+		true_colors.reserve(settings.true_color_cache_size);
+		clock_hand = 0;
+		}
+
 	initialized = true;
 }
 
@@ -69,14 +91,10 @@ Colors::~Colors()
 	if (!initialized)
 		return;
 
-	int screen = XDefaultScreen(display);
-	Visual* visual = XDefaultVisual(display, screen);
-	Colormap colormap = XDefaultColormap(display, screen);
-
 	for (int i = 0; i < 256; ++i)
 		XftColorFree(display, visual, colormap, &indexed_colors[i]);
-	for (auto& color: true_colors)
-		XftColorFree(display, visual, colormap, &color.second);
+	for (auto& true_color: true_colors)
+		XftColorFree(display, visual, colormap, &true_color.xft_color);
 }
 
 
@@ -87,23 +105,123 @@ const XftColor* Colors::xft_color(uint32_t color)
 
 	// Otherwise, treat it as true color (even if the true_color_bit isn't set).
 	color &= ~true_color_bit;
-	if (true_colors.find(color) == true_colors.end()) {
-		// Don't have it yet.
-		XRenderColor render_color;
-		render_color.alpha = 0xFFFF;
-		render_color.red = (color & 0xFF0000) >> 8 | (color & 0xFF0000) >> 16;
-		render_color.green = (color & 0xFF00) | (color & 0xFF00) >> 8;
-		render_color.blue = (color & 0xFF) << 8 | (color & 0xFF);
+	if (!is_true_color_visual)
+		return allocated_true_color(color);
+	render_color_for(color, &computed_color.color);
+	computed_color.pixel =
+		red_channel.pixel_bits(computed_color.color.red) |
+		green_channel.pixel_bits(computed_color.color.green) |
+		blue_channel.pixel_bits(computed_color.color.blue);
+	return &computed_color;
+}
 
-		int screen = XDefaultScreen(display);
-		Visual* visual = XDefaultVisual(display, screen);
-		Colormap colormap = XDefaultColormap(display, screen);
-		XftColorAllocValue(
-			display, visual, colormap,
-			&render_color, &true_colors[color]);
+
+const XftColor* Colors::allocated_true_color(uint32_t color)
+{
+	// Look it up.
+	size_t mask = true_color_table.size() - 1;
+	size_t slot = true_color_slot(color);
+	for (; true_color_table[slot] >= 0; slot = (slot + 1) & mask) {
+		AllocatedColor& true_color = true_colors[true_color_table[slot]];
+		if (true_color.color == color) {
+			true_color.recently_used = true;
+			return &true_color.xft_color;
+			}
 		}
-	return &true_colors[color];
+
+	// Don't have it yet.  Make room for it if we need to.
+	int index;
+	if (true_colors.size() < settings.true_color_cache_size || true_colors.empty()) {
+		index = true_colors.size();
+		true_colors.emplace_back();
+		}
+	else {
+		// Give recently-used colors a second chance.
+		while (true_colors[clock_hand].recently_used) {
+			true_colors[clock_hand].recently_used = false;
+			clock_hand = (clock_hand + 1) % true_colors.size();
+			}
+		index = clock_hand;
+		clock_hand = (clock_hand + 1) % true_colors.size();
+		AllocatedColor& evicted = true_colors[index];
+		XftColorFree(display, visual, colormap, &evicted.xft_color);
+		size_t evicted_slot = true_color_slot(evicted.color);
+		while (true_color_table[evicted_slot] != index)
+			evicted_slot = (evicted_slot + 1) & mask;
+		remove_true_color_slot(evicted_slot);
+
+		// That may have moved things around, so find the slot for the new color
+		// again.
+		slot = true_color_slot(color);
+		while (true_color_table[slot] >= 0)
+			slot = (slot + 1) & mask;
+		}
+
+	// Allocate it.
+	AllocatedColor& true_color = true_colors[index];
+	true_color.color = color;
+	true_color.recently_used = true;
+	XRenderColor render_color;
+	render_color_for(color, &render_color);
+	XftColorAllocValue(display, visual, colormap, &render_color, &true_color.xft_color);
+	true_color_table[slot] = index;
+	return &true_color.xft_color;
+}
+
+
+void Colors::remove_true_color_slot(size_t slot)
+{
+	// With linear probing, we can't just empty the slot; anything after it
+	// that probed past it would no longer be found.  So we move those back.
+	size_t mask = true_color_table.size() - 1;
+	size_t next_slot = slot;
+	while (true) {
+		true_color_table[slot] = -1;
+		while (true) {
+			next_slot = (next_slot + 1) & mask;
+			if (true_color_table[next_slot] < 0)
+				return;
+			// Entries whose home slot is cyclically in (slot, next_slot] stay
+			// where they are.
+			size_t home_slot = true_color_slot(true_colors[true_color_table[next_slot]].color);
+			bool stays =
+				slot <= next_slot ?
+				(slot < home_slot && home_slot <= next_slot) :
+				(slot < home_slot || home_slot <= next_slot);
+			if (!stays)
+				break;
+			}
+		true_color_table[slot] = true_color_table[next_slot];
+		slot = next_slot;
+		}
+}
+
+
+void Colors::render_color_for(uint32_t color, XRenderColor* render_color)
+{
+	render_color->alpha = 0xFFFF;
+	render_color->red = (color & 0xFF0000) >> 8 | (color & 0xFF0000) >> 16;
+	render_color->green = (color & 0xFF00) | (color & 0xFF00) >> 8;
+	render_color->blue = (color & 0xFF) << 8 | (color & 0xFF);
 }
 
 
+void Colors::Channel::set_mask(unsigned long mask)
+{
+	shift = 0;
+	bits = 0;
+	if (mask == 0)
+		return;
+	while ((mask & 1) == 0) {
+		mask >>= 1;
+		shift += 1;
+		}
+	while ((mask & 1) != 0) {
+		mask >>= 1;
+		bits += 1;
+		}
+	if (bits > 16)
+		bits = 16;
+}
+
 
@@ -3,10 +3,12 @@
 
 #include <stdint.h>
 #include <X11/Xft/Xft.h>
-#include <map>
+#include <vector>
 
 // Colors are represented as uint32_t's.  If the high bit is set, it's a "true
 // color" represented as 0x80rrggbb.  Otherwise, it's an ANSI color index.
+//
+// The XftColor returned for a true color is only good until the next call.
 
 
 class Colors {
@@ -24,9 +26,45 @@ class Colors {
 	protected:
 		bool	initialized;
 		XftColor	indexed_colors[256];
-		std::map<uint32_t, XftColor>	true_colors;
 
 		Display*	display;
+		Visual*	visual;
+		Colormap	colormap;
+
+		// On TrueColor visuals, true colors' pixels are computed directly from
+		// the visual's masks.
+		bool	is_true_color_visual;
+		struct Channel {
+			int	shift, bits;
+			void	set_mask(unsigned long mask);
+			unsigned long	pixel_bits(uint16_t value) {
+				return (unsigned long) (value >> (16 - bits)) << shift;
+				}
+			};
+		Channel	red_channel, green_channel, blue_channel;
+		XftColor	computed_color;
+
+		// Otherwise, they need to be allocated, so we keep a limited number of
+		// them ("settings.true_color_cache_size").  "true_color_table" is an
+		// open-addressing hash table of indices into "true_colors", which are
+		// evicted in (roughly) least-recently-used order by the "clock"
+		// algorithm.
+		struct AllocatedColor {
+			uint32_t	color;
+			bool	recently_used;
+			XftColor	xft_color;
+			};
+		std::vector<AllocatedColor>	true_colors;
+		std::vector<int>	true_color_table; 	// -1: empty.
+		int	true_color_table_bits;
+		size_t	clock_hand;
+
+		size_t	true_color_slot(uint32_t color) {
+			return (color * 2654435761U) >> (32 - true_color_table_bits);
+			}
+		const XftColor*	allocated_true_color(uint32_t color);
+		void	remove_true_color_slot(size_t slot);
+		static void	render_color_for(uint32_t color, XRenderColor* render_color);
 	};
 
 extern Colors colors;
@@ -0,0 +1,281 @@
+#include "DiskCache.h"
+#include "Settings.h"
+#include <sstream>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+enum {
+	metrics_magic = 0x73706d32, 	// "spm2".
+	};
+
+struct MetricsHeader {
+	uint32_t	magic;
+	uint32_t	num_metrics;
+	int64_t	mtime, size;
+	uint64_t	config_stamp;
+	uint32_t	key_length;
+	uint32_t	reserved;
+	// Followed by the key, then the metrics.
+	};
+
+
+// A file mapped into memory, for as long as this is around.
+class MappedFile {
+	public:
+		MappedFile(const std::string& path)
+			: data(nullptr), size(0) {
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				return;
+			struct stat stat_buf;
+			if (fstat(fd, &stat_buf) == 0 && stat_buf.st_size > 0) {
+				void* mapping = mmap(nullptr, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (mapping != MAP_FAILED) {
+					data = (const char*) mapping;
+					size = stat_buf.st_size;
+					}
+				}
+			close(fd);
+			}
+		~MappedFile() {
+			if (data)
+				munmap((void*) data, size);
+			}
+
+		const char*	data;
+		size_t	size;
+	};
+
+
+FcPattern* DiskCache::font_match(FcPattern* pattern)
+{
+	std::string key = pattern_key(pattern);
+	MappedFile file(path_for("match", key));
+	if (file.data == nullptr)
+		return nullptr;
+
+	// The file is the key, the match, and the file and configuration stamps,
+	// one per line.
+	std::istringstream lines(std::string(file.data, file.size));
+	std::string file_key, match_str;
+	FileStamp stamp;
+	uint64_t file_config_stamp;
+	std::getline(lines, file_key);
+	std::getline(lines, match_str);
+	lines >> stamp.mtime >> stamp.size >> file_config_stamp;
+	if (lines.fail() || file_key != key || file_config_stamp != config_stamp())
+		return nullptr;
+
+	FcPattern* match = FcNameParse((const FcChar8*) match_str.c_str());
+	if (match == nullptr)
+		return nullptr;
+	FileStamp current_stamp;
+	bool up_to_date =
+		get_file_stamp(match, &current_stamp) &&
+		current_stamp.mtime == stamp.mtime && current_stamp.size == stamp.size;
+	if (!up_to_date) {
+		FcPatternDestroy(match);
+		return nullptr;
+		}
+	return match;
+}
+
+
+void DiskCache::save_font_match(FcPattern* pattern, FcPattern* match)
+{
+	FileStamp stamp;
+	if (!get_file_stamp(match, &stamp))
+		return;
+	std::string key = pattern_key(pattern);
+	std::ostringstream contents;
+	contents << key << '\n' << pattern_key(match) << '\n';
+	contents << stamp.mtime << ' ' << stamp.size << ' ' << config_stamp() << '\n';
+	write_file(path_for("match", key), contents.str());
+}
+
+
+bool DiskCache::load_glyph_metrics(
+	FcPattern* font_pattern, GlyphMetrics* metrics, int num_metrics)
+{
+	FileStamp stamp;
+	if (!get_file_stamp(font_pattern, &stamp))
+		return false;
+	std::string key = pattern_key(font_pattern);
+	MappedFile file(path_for("metrics", key));
+	if (file.data == nullptr || file.size < sizeof(MetricsHeader))
+		return false;
+
+	MetricsHeader header;
+	memcpy(&header, file.data, sizeof(header));
+	size_t expected_size =
+		sizeof(header) + header.key_length + header.num_metrics * sizeof(GlyphMetrics);
+	bool valid =
+		header.magic == metrics_magic &&
+		header.mtime == stamp.mtime && header.size == stamp.size &&
+		header.config_stamp == config_stamp() &&
+		(int) header.num_metrics == num_metrics &&
+		header.key_length == key.size() && file.size == expected_size &&
+		memcmp(file.data + sizeof(header), key.data(), key.size()) == 0;
+	if (!valid)
+		return false;
+
+	memcpy(
+		metrics, file.data + sizeof(header) + header.key_length,
+		num_metrics * sizeof(GlyphMetrics));
+	return true;
+}
+
+
+void DiskCache::save_glyph_metrics(
+	FcPattern* font_pattern, const GlyphMetrics* metrics, int num_metrics)
+{
+	MetricsHeader header;
+	memset(&header, 0, sizeof(header));
+	FileStamp stamp;
+	if (!get_file_stamp(font_pattern, &stamp))
+		return;
+	std::string key = pattern_key(font_pattern);
+	header.magic = metrics_magic;
+	header.num_metrics = num_metrics;
+	header.mtime = stamp.mtime;
+	header.size = stamp.size;
+	header.config_stamp = config_stamp();
+	header.key_length = key.size();
+
+	std::string contents((const char*) &header, sizeof(header));
+	contents += key;
+	contents.append((const char*) metrics, num_metrics * sizeof(GlyphMetrics));
+	write_file(path_for("metrics", key), contents);
+}
+
+
+bool DiskCache::get_file_stamp(FcPattern* font_pattern, FileStamp* stamp_out)
+{
+	FcChar8* file_name = nullptr;
+	if (FcPatternGetString(font_pattern, FC_FILE, 0, &file_name) != FcResultMatch)
+		return false;
+	struct stat stat_buf;
+	if (stat((const char*) file_name, &stat_buf) != 0)
+		return false;
+	stamp_out->mtime = stat_buf.st_mtime;
+	stamp_out->size = stat_buf.st_size;
+	return true;
+}
+
+
+uint64_t DiskCache::config_stamp()
+{
+	// A hash of the modification times of fontconfig's configuration files
+	// and directories, and of the font directories (which change when fonts
+	// are added or removed).  It only needs to be figured once per run.
+	static uint64_t stamp = 0;
+	if (stamp != 0)
+		return stamp;
+
+	stamp = 14695981039346656037ULL; 	// FNV-1a.
+	auto add_to_stamp = [](uint64_t value) {
+		for (int i = 0; i < 8; ++i) {
+			stamp ^= (value >> (i * 8)) & 0xFF;
+			stamp *= 1099511628211ULL;
+			}
+		};
+	FcStrList* lists[] = {
+		FcConfigGetConfigFiles(nullptr),
+		FcConfigGetConfigDirs(nullptr),
+		FcConfigGetFontDirs(nullptr),
+		};
+	for (FcStrList* list: lists) {
+		if (list == nullptr)
+			continue;
+		while (FcChar8* path = FcStrListNext(list)) {
+			struct stat stat_buf;
+			if (stat((const char*) path, &stat_buf) != 0)
+				continue;
+			add_to_stamp(stat_buf.st_mtim.tv_sec);
+			add_to_stamp(stat_buf.st_mtim.tv_nsec);
+			add_to_stamp(stat_buf.st_size);
+			}
+		FcStrListDone(list);
+		}
+	if (stamp == 0)
+		stamp = 1;
+	return stamp;
+}
+
+
+std::string DiskCache::pattern_key(FcPattern* pattern)
+{
+	// The charset and languages are big, and don't affect anything we use the
+	// pattern for (Xft gets them from the font file if they're missing).
+	FcPattern* trimmed = FcPatternDuplicate(pattern);
+	FcPatternDel(trimmed, FC_CHARSET);
+	FcPatternDel(trimmed, FC_LANG);
+	FcChar8* unparsed = FcNameUnparse(trimmed);
+	FcPatternDestroy(trimmed);
+	if (unparsed == nullptr)
+		return "";
+	std::string key = (const char*) unparsed;
+	free(unparsed);
+	return key;
+}
+
+
+std::string DiskCache::path_for(const char* kind, const std::string& key)
+{
+	std::string cache_dir;
+	const char* env_dir = getenv("XDG_CACHE_HOME");
+	if (env_dir)
+		cache_dir = env_dir;
+	else {
+		// Default to ~/.cache.
+		std::string home_dir = settings.home_path();
+		if (home_dir.empty())
+			return "";
+		cache_dir = home_dir + "/.cache";
+		}
+
+	// Name the file with a hash (FNV-1a) of the key.  The key is stored in the
+	// file too, in case of collisions.
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (unsigned char c: key) {
+		hash ^= c;
+		hash *= 0x100000001b3ULL;
+		}
+	char file_name[64];
+	snprintf(file_name, sizeof(file_name), "/spft/%s-%016llx", kind, (unsigned long long) hash);
+	return cache_dir + file_name;
+}
+
+
+void DiskCache::write_file(const std::string& path, const std::string& contents)
+{
+	if (path.empty())
+		return;
+
+	// Make the directories.
+	size_t slash = path.rfind('/');
+	std::string dir = path.substr(0, slash);
+	if (mkdir(dir.c_str(), 0700) != 0) {
+		std::string parent_dir = dir.substr(0, dir.rfind('/'));
+		mkdir(parent_dir.c_str(), 0700);
+		mkdir(dir.c_str(), 0700);
+		}
+
+	// Write to a temporary file and rename it into place, so other spfts
+	// starting at the same time never see a partial file.
+	std::string temp_path = path + "." + std::to_string(getpid());
+	int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return;
+	bool ok = write(fd, contents.data(), contents.size()) == (ssize_t) contents.size();
+	close(fd);
+	if (!ok || rename(temp_path.c_str(), path.c_str()) != 0)
+		unlink(temp_path.c_str());
+}
+
+
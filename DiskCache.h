@@ -0,0 +1,54 @@
+#ifndef DiskCache_h
+#define DiskCache_h
+
+#include <fontconfig/fontconfig.h>
+#include <string>
+#include <stdint.h>
+
+// Keeps the results of slow startup work (matching fonts, and measuring their
+// glyphs) in files in "$XDG_CACHE_HOME/spft", so the next spft can skip it.
+// Everything is tagged with the modification time and size of the font file
+// it came from, and ignored if that changes.  Font matches (and which glyphs
+// come from fallback fonts) also depend on fontconfig's configuration and
+// which fonts are installed, so they're tagged with a stamp of those too.  Any problem with the cache just means it isn't
+// used.
+
+
+class DiskCache {
+	public:
+		// Font matching.  "pattern" is the requested pattern with just
+		// XftDefaultSubstitute() done on it.  Returns nullptr if it's not in the
+		// cache.
+		static FcPattern*	font_match(FcPattern* pattern);
+		static void	save_font_match(FcPattern* pattern, FcPattern* match);
+
+		// Glyph metrics, for the first "num_metrics" characters of the font.
+		struct GlyphMetrics {
+			uint32_t	index;
+			int32_t	advance; 	// -1: not known.
+			uint32_t	fallback;
+				// 0: the font itself; otherwise, 1 + its place in the font's
+				// FcFontSort() list.
+			};
+		static bool	load_glyph_metrics(
+			FcPattern* font_pattern, GlyphMetrics* metrics, int num_metrics);
+		static void	save_glyph_metrics(
+			FcPattern* font_pattern, const GlyphMetrics* metrics, int num_metrics);
+
+		// Figured the first time it's called, which should be before any other
+		// threads use the cache.
+		static uint64_t	config_stamp();
+
+	protected:
+		struct FileStamp {
+			int64_t	mtime, size;
+			};
+		static bool	get_file_stamp(FcPattern* font_pattern, FileStamp* stamp_out);
+		static std::string	pattern_key(FcPattern* pattern);
+		static std::string	path_for(const char* kind, const std::string& key);
+		static void	write_file(const std::string& path, const std::string& contents);
+	};
+
+
+#endif 	// !DiskCache_h
+
@@ -0,0 +1,149 @@
+#include "DrawBatch.h"
+#include "Colors.h"
+#include "Settings.h"
+
+
+void DrawBatch::add_clear(int x, int y, int width, int height)
+{
+	add_rect(clears, x, y, width, height);
+}
+
+
+void DrawBatch::add_background(uint32_t color, int x, int y, int width, int height)
+{
+	add_rect(
+		items_for(color, backgrounds, num_background_colors),
+		x, y, width, height);
+}
+
+
+void DrawBatch::add_glyph(uint32_t color, XftFont* font, FT_UInt glyph, int x, int y)
+{
+	XftGlyphFontSpec spec;
+	spec.font = font;
+	spec.glyph = glyph;
+	spec.x = x;
+	spec.y = y;
+	items_for(color, glyphs, num_glyph_colors).push_back(spec);
+}
+
+
+void DrawBatch::add_line(uint32_t color, int x1, int x2, int y)
+{
+	std::vector<XSegment>& segments = items_for(color, lines, num_line_colors);
+	if (!segments.empty()) {
+		// Continue the last line if this one picks up where it left off.
+		XSegment& last = segments.back();
+		if (last.y1 == y && last.x2 + 1 == x1) {
+			last.x2 = x2;
+			return;
+			}
+		}
+	XSegment segment;
+	segment.x1 = x1;
+	segment.y1 = y;
+	segment.x2 = x2;
+	segment.y2 = y;
+	segments.push_back(segment);
+}
+
+
+bool DrawBatch::empty()
+{
+	return
+		clears.empty() && num_background_colors == 0 &&
+		num_glyph_colors == 0 && num_line_colors == 0;
+}
+
+
+void DrawBatch::draw(Display* display, Drawable drawable, GC gc, XftDraw* xft_draw)
+{
+	Picture picture = XftDrawPicture(xft_draw);
+
+	// Clears.
+	if (!clears.empty()) {
+		XRenderFillRectangles(
+			display, PictOpSrc, picture,
+			&colors.xft_color(settings.default_background_color)->color,
+			clears.data(), clears.size());
+		clears.clear();
+		}
+
+	// Backgrounds.
+	for (int i = 0; i < num_background_colors; ++i) {
+		ColorItems<XRectangle>& rects = backgrounds[i];
+		XRenderFillRectangles(
+			display, PictOpSrc, picture, &colors.xft_color(rects.color)->color,
+			rects.items.data(), rects.items.size());
+		rects.items.clear();
+		}
+	num_background_colors = 0;
+
+	// Glyphs.
+	for (int i = 0; i < num_glyph_colors; ++i) {
+		ColorItems<XftGlyphFontSpec>& specs = glyphs[i];
+		XftDrawGlyphFontSpec(
+			xft_draw, colors.xft_color(specs.color),
+			specs.items.data(), specs.items.size());
+		specs.items.clear();
+		}
+	num_glyph_colors = 0;
+
+	// Decorations.
+	for (int i = 0; i < num_line_colors; ++i) {
+		ColorItems<XSegment>& segments = lines[i];
+		XSetForeground(display, gc, colors.xft_color(segments.color)->pixel);
+		XDrawSegments(
+			display, drawable, gc,
+			segments.items.data(), segments.items.size());
+		segments.items.clear();
+		}
+	num_line_colors = 0;
+}
+
+
+template<class Item>
+std::vector<Item>& DrawBatch::items_for(
+	uint32_t color, std::vector<ColorItems<Item>>& lists, int& num_used)
+{
+	// There are usually only a few colors, so a linear search is fine.
+	for (int i = 0; i < num_used; ++i) {
+		if (lists[i].color == color)
+			return lists[i].items;
+		}
+	if (num_used >= (int) lists.size())
+		lists.resize(num_used + 1);
+	ColorItems<Item>& new_list = lists[num_used++];
+	new_list.color = color;
+	return new_list.items;
+}
+
+
+void DrawBatch::add_rect(std::vector<XRectangle>& rects, int x, int y, int width, int height)
+{
+	if (width <= 0 || height <= 0)
+		return;
+
+	// Merge with the last rectangle if they line up, either side by side (like
+	// the backgrounds of consecutive runs) or one atop the other (like whole
+	// rows).
+	if (!rects.empty()) {
+		XRectangle& last = rects.back();
+		if (last.y == y && last.height == height && last.x + last.width == x) {
+			last.width += width;
+			return;
+			}
+		if (last.x == x && last.width == width && last.y + last.height == y) {
+			last.height += height;
+			return;
+			}
+		}
+	XRectangle rect;
+	rect.x = x;
+	rect.y = y;
+	rect.width = width;
+	rect.height = height;
+	rects.push_back(rect);
+}
+
+
@@ -0,0 +1,50 @@
+#ifndef DrawBatch_h
+#define DrawBatch_h
+
+#include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+#include <vector>
+#include <stdint.h>
+
+// Collects everything drawn in a frame, so it can all be drawn with a few
+// requests per color instead of several per run.  Things are drawn in layers:
+// cleared areas first, then backgrounds, then glyphs, then decorations.
+
+
+class DrawBatch {
+	public:
+		DrawBatch()
+			: num_background_colors(0), num_glyph_colors(0), num_line_colors(0) {}
+
+		void	add_clear(int x, int y, int width, int height);
+		void	add_background(uint32_t color, int x, int y, int width, int height);
+		void	add_glyph(uint32_t color, XftFont* font, FT_UInt glyph, int x, int y);
+		void	add_line(uint32_t color, int x1, int x2, int y);
+		bool	empty();
+
+		void	draw(Display* display, Drawable drawable, GC gc, XftDraw* xft_draw);
+
+	protected:
+		template<class Item> struct ColorItems {
+			uint32_t	color;
+			std::vector<Item>	items;
+			};
+		template<class Item>
+			std::vector<Item>&	items_for(
+				uint32_t color, std::vector<ColorItems<Item>>& lists, int& num_used);
+		static void	add_rect(std::vector<XRectangle>& rects, int x, int y, int width, int height);
+
+		// These are kept around (but emptied) between draws, to avoid
+		// reallocating them.
+		std::vector<XRectangle>	clears;
+		std::vector<ColorItems<XRectangle>>	backgrounds;
+		int	num_background_colors;
+		std::vector<ColorItems<XftGlyphFontSpec>>	glyphs;
+		int	num_glyph_colors;
+		std::vector<ColorItems<XSegment>>	lines;
+		int	num_line_colors;
+	};
+
+
+#endif 	// !DrawBatch_h
+
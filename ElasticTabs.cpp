@@ -0,0 +1,84 @@
+#include "ElasticTabs.h"
+#include "Line.h"
+
+
+uint64_t ElasticTabs::last_generation = 0;
+uint64_t ElasticTabs::change_count = 0;
+
+
+void ElasticTabs::set_line_widths(Line* line, const std::vector<int>& widths)
+{
+	if (line->elastic_widths_font_generation == font_generation)
+		remove_widths(line->elastic_widths);
+	line->elastic_widths = widths;
+	line->elastic_widths_font_generation = font_generation;
+	add_widths(widths);
+	is_dirty = true;
+}
+
+
+void ElasticTabs::remove_line(Line* line)
+{
+	if (line->elastic_widths_font_generation == font_generation)
+		remove_widths(line->elastic_widths);
+	line->elastic_widths.clear();
+	dirty_lines.erase(line);
+	is_dirty = true;
+	change_count += 1;
+}
+
+
+void ElasticTabs::fonts_changed(uint64_t new_font_generation)
+{
+	// Lines' widths from before this are no longer counted (see
+	// set_line_widths()).
+	width_counts.clear();
+	font_generation = new_font_generation;
+	is_dirty = true;
+}
+
+
+void ElasticTabs::update_column_widths()
+{
+	// Trailing columns that no line has any more go away.
+	int num_columns = width_counts.size();
+	while (num_columns > 0 && width_counts[num_columns - 1].empty())
+		num_columns -= 1;
+	width_counts.resize(num_columns);
+
+	std::vector<int> new_column_widths(num_columns, 0);
+	for (int which_column = 0; which_column < num_columns; ++which_column) {
+		const std::map<int, int>& counts = width_counts[which_column];
+		if (!counts.empty())
+			new_column_widths[which_column] = counts.rbegin()->first;
+		}
+	if (new_column_widths != column_widths) {
+		column_widths.swap(new_column_widths);
+		widths_changed();
+		}
+	is_dirty = false;
+}
+
+
+void ElasticTabs::add_widths(const std::vector<int>& widths)
+{
+	if (widths.size() > width_counts.size())
+		width_counts.resize(widths.size());
+	int which_column = 0;
+	for (int width: widths)
+		width_counts[which_column++][width] += 1;
+}
+
+
+void ElasticTabs::remove_widths(const std::vector<int>& widths)
+{
+	int which_column = 0;
+	for (int width: widths) {
+		std::map<int, int>& counts = width_counts[which_column++];
+		auto it = counts.find(width);
+		if (it != counts.end() && --it->second <= 0)
+			counts.erase(it);
+		}
+}
+
+
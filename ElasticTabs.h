@@ -2,15 +2,19 @@
 #define ElasticTabs_h
 
 #include <vector>
+#include <map>
+#include <unordered_set>
 #include <stdint.h>
 
+class Line;
+
 
 class ElasticTabs {
 	public:
 		ElasticTabs(int num_right_columns_in) :
 			num_right_columns(num_right_columns_in),
-			reference_count(0), is_dirty(false), first_dirty_line(INT64_MAX)
-			{}
+			reference_count(0), font_generation(0), is_dirty(false)
+			{ widths_changed(); }
 
 		std::vector<int>	column_widths;
 		int num_right_columns;
@@ -24,16 +28,47 @@ class ElasticTabs {
 				delete this;
 			}
 
-		// Dirtiness.
-		bool is_dirty;
-		int64_t first_dirty_line;
-		void undirtify() {
-			is_dirty = false;
-			first_dirty_line = INT64_MAX;
+		// The generation changes whenever the column widths do.  Like
+		// Line::version, it's unique across all ElasticTabs.
+		uint64_t	generation;
+		void	widths_changed() { generation = ++last_generation; }
+
+		// Each line in the group contributes its own widths (kept on the Line),
+		// and each column's width is the largest of them.  The contributions are
+		// counted per column, so a line can change without rescanning the
+		// whole group.
+		void	set_line_widths(Line* line, const std::vector<int>& widths);
+		void	remove_line(Line* line);
+		void	update_column_widths();
+
+		// The widths are only good for the fonts they were measured with.  When
+		// those change, all the lines' contributions are dropped, and the lines
+		// need to be measured again.
+		uint64_t	font_generation;
+		void	fonts_changed(uint64_t new_font_generation);
+
+		// Dirtiness.  "dirty_lines" are the lines whose widths need to be
+		// measured again; "is_dirty" means the column widths need updating.
+		bool	is_dirty;
+		std::unordered_set<Line*>	dirty_lines;
+		void	line_changed(Line* line) {
+			dirty_lines.insert(line);
+			is_dirty = true;
+			change_count += 1;
 			}
-	};
 
+		// Counts changes to lines in any group, so it's cheap to tell whether
+		// anything has changed.
+		static uint64_t	change_count;
 
-#endif 	// ElasticTabs_h
+	protected:
+		static uint64_t	last_generation;
+
+		std::vector<std::map<int, int>>	width_counts;
+			// For each column, how many lines have each width.
+		void	add_widths(const std::vector<int>& widths);
+		void	remove_widths(const std::vector<int>& widths);
+	};
 
 
+#endif 	// ElasticTabs_h
@@ -1,15 +1,25 @@
 #include "FontSet.h"
+#include "DiskCache.h"
 #include <stdexcept>
 #include <stdio.h>
 
+static const char* style_names[] = { "regular", "bold", "italic", "bold italic" };
+
 
 FontSet::FontSet(
 	std::string spec,
 	Display* display_in,  int screen,
-	double font_size_override, bool skip_italics)
-	: display(display_in)
+	double font_size_override, bool skip_italics_in)
+	: display(display_in), skip_italics(skip_italics_in)
 {
 	FcResult result;
+	for (int i = 0; i < 4; ++i) {
+		xft_fonts[i] = nullptr;
+		glyph_caches[i] = nullptr;
+		style_patterns[i] = nullptr;
+		style_keys[i] = nullptr;
+		style_matches[i] = nullptr;
+		}
 
 	// Regular.
 	FcPattern* pattern = FcNameParse((const FcChar8*) spec.c_str());
@@ -18,8 +28,17 @@ FontSet::FontSet(
 		FcPatternDel(pattern, FC_SIZE);
 		FcPatternAddDouble(pattern, FC_PIXEL_SIZE, font_size_override);
 		}
-	XftDefaultSubstitute(display, screen, pattern);
-	FcPattern* match = XftFontMatch(display, screen, pattern, &result);
+	// The disk cache is keyed by the pattern with just Xft's substitutions, which
+	// fill in the display's size and DPI; XftFontMatch() (working on the
+	// unsubstituted pattern) does fontconfig's before them, as usual.
+	FcPattern* key = FcPatternDuplicate(pattern);
+	XftDefaultSubstitute(display, screen, key);
+	FcPattern* match = DiskCache::font_match(key);
+	if (match == nullptr) {
+		match = XftFontMatch(display, screen, pattern, &result);
+		if (match)
+			DiskCache::save_font_match(key, match);
+		}
 #ifdef SHOW_REAL_FONT
 	FcChar8* format_name = FcPatternFormat(match, (FcChar8*) "%{=fcmatch} size: %{size} pixelsize: %{pixelsize}");
 	printf("Real font: \"%s\".\n", format_name);
@@ -28,64 +47,90 @@ FontSet::FontSet(
 	xft_fonts[0] = XftFontOpenPattern(display, match);
 	if (xft_fonts[0] == nullptr)
 		throw std::runtime_error("Couldn't open the font.");
+	glyph_caches[0] = new GlyphCache(display, xft_fonts[0]);
 
 	// Get the font size used.
 	used_font_size = 0;
-	result = FcPatternGetDouble(pattern, FC_PIXEL_SIZE, 0, &used_font_size);
+	result = FcPatternGetDouble(key, FC_PIXEL_SIZE, 0, &used_font_size);
+	FcPatternDestroy(key);
 
-	// Italics.
-	if (skip_italics) {
-		xft_fonts[2] = xft_fonts[0];
-		// We'll make bold-italic be the same as bold, below.
-		}
-	else {
-		// Italic.
-		// (We do this first because we'll be clobbering the weight later.)
-		FcPatternDel(pattern, FC_SLANT);
-		FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
-		match = XftFontMatch(display, screen, pattern, &result);
-		xft_fonts[2] = XftFontOpenPattern(display, match);
-		if (xft_fonts[2] == nullptr) {
-			fprintf(stderr, "Couldn't open italic font.");
-			xft_fonts[2] = xft_fonts[0];
+	// Set up the patterns for the other styles.  The Xft substitutions need the
+	// display, so the substitutions are done here, and the matching (unless
+	// it's already in the disk cache) is left for the helper thread.
+	for (int which = 1; which < 4; ++which) {
+		if (skip_italics && (which & 2) != 0) {
+			// These will be the same as the non-italic ones.
+			continue;
 			}
-
-		// Bold italic.
-		FcPatternDel(pattern, FC_WEIGHT);
-		FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
-		match = XftFontMatch(display, screen, pattern, &result);
-		xft_fonts[3] = XftFontOpenPattern(display, match);
-		if (xft_fonts[3] == nullptr) {
-			fprintf(stderr, "Couldn't open bold italic font.");
-			xft_fonts[3] = xft_fonts[0];
+		FcPattern* style_pattern = FcPatternDuplicate(pattern);
+		if (which & 1) {
+			FcPatternDel(style_pattern, FC_WEIGHT);
+			FcPatternAddInteger(style_pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
+			}
+		if (which & 2) {
+			FcPatternDel(style_pattern, FC_SLANT);
+			FcPatternAddInteger(style_pattern, FC_SLANT, FC_SLANT_ITALIC);
 			}
+		else if (!skip_italics) {
+			FcPatternDel(style_pattern, FC_SLANT);
+			FcPatternAddInteger(style_pattern, FC_SLANT, FC_SLANT_ROMAN);
+			}
+		FcPattern* style_key = FcPatternDuplicate(style_pattern);
+		XftDefaultSubstitute(display, screen, style_key);
+		style_matches[which] = DiskCache::font_match(style_key);
+		if (style_matches[which]) {
+			FcPatternDestroy(style_key);
+			FcPatternDestroy(style_pattern);
+			continue;
+			}
+		// Same order as XftFontMatch().
+		FcConfigSubstitute(nullptr, style_pattern, FcMatchPattern);
+		XftDefaultSubstitute(display, screen, style_pattern);
+		style_patterns[which] = style_pattern;
+		style_keys[which] = style_key;
 		}
+	FcPatternDestroy(pattern);
 
-	// Bold.
-	if (skip_italics) {
-		FcPatternDel(pattern, FC_WEIGHT);
-		FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
-		}
-	else {
-		FcPatternDel(pattern, FC_SLANT);
-		FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ROMAN);
-		}
-	match = XftFontMatch(display, screen, pattern, &result);
-	xft_fonts[1] = XftFontOpenPattern(display, match);
-	if (xft_fonts[1] == nullptr) {
-		fprintf(stderr, "Couldn't open bold font.");
-		xft_fonts[1] = xft_fonts[0];
-		}
-	if (skip_italics)
-		xft_fonts[3] = xft_fonts[1];
+	// The helper thread may be first to save to the disk cache; make sure the
+	// config stamp it uses is already figured.
+	DiskCache::config_stamp();
 
-	FcPatternDestroy(pattern);
+	matcher = std::thread([this]() {
+		for (int which = 1; which < 4; ++which) {
+			if (style_patterns[which] == nullptr)
+				continue;
+			FcResult result;
+			style_matches[which] = FcFontMatch(nullptr, style_patterns[which], &result);
+			if (style_matches[which])
+				DiskCache::save_font_match(style_keys[which], style_matches[which]);
+			FcPatternDestroy(style_patterns[which]);
+			FcPatternDestroy(style_keys[which]);
+			style_patterns[which] = nullptr;
+			style_keys[which] = nullptr;
+			}
+		});
+}
+
+
+void FontSet::save_metrics()
+{
+	for (int i = 0; i < 4; ++i) {
+		if (glyph_caches[i])
+			glyph_caches[i]->save_metrics();
+		}
 }
 
 
 FontSet::~FontSet()
 {
+	if (matcher.joinable())
+		matcher.join();
+
 	for (int i = 3; i >= 0; --i) {
+		if (style_matches[i])
+			FcPatternDestroy(style_matches[i]);
+		if (xft_fonts[i] == nullptr)
+			continue;
 		bool is_copy = false;
 		for (int j = i - 1; j >= 0; --j) {
 			if (xft_fonts[i] == xft_fonts[j]) {
@@ -93,10 +138,60 @@ FontSet::~FontSet()
 				break;
 				}
 			}
-		if (!is_copy)
+		if (!is_copy) {
+			delete glyph_caches[i];
 			XftFontClose(display, xft_fonts[i]);
+			}
+		glyph_caches[i] = nullptr;
 		xft_fonts[i] = nullptr;
 		}
 }
 
 
+void FontSet::open_style(int which)
+{
+	if (skip_italics && (which & 2) != 0) {
+		// Same as the non-italic one.
+		int non_italic = which & ~2;
+		if (xft_fonts[non_italic] == nullptr)
+			open_style(non_italic);
+		xft_fonts[which] = xft_fonts[non_italic];
+		glyph_caches[which] = glyph_caches[non_italic];
+		return;
+		}
+
+	if (matcher.joinable())
+		matcher.join();
+
+	XftFont* font = nullptr;
+	bool opened = false;
+	if (style_matches[which]) {
+		font = XftFontOpenPattern(display, style_matches[which]);
+		if (font) {
+			// The font owns the pattern now.
+			style_matches[which] = nullptr;
+			opened = true;
+			}
+		}
+	if (font == nullptr) {
+		fprintf(stderr, "Couldn't open %s font.", style_names[which]);
+		font = xft_fonts[0];
+		}
+
+	// Styles that ended up with the same font share it and its cache.
+	for (int i = 0; i < 4; ++i) {
+		if (i != which && xft_fonts[i] == font) {
+			if (opened) {
+				// Xft gave us another reference to a font we already had.
+				XftFontClose(display, font);
+				}
+			glyph_caches[which] = glyph_caches[i];
+			break;
+			}
+		}
+	xft_fonts[which] = font;
+	if (glyph_caches[which] == nullptr)
+		glyph_caches[which] = new GlyphCache(display, font);
+}
+
+
@@ -1,8 +1,10 @@
 #pragma once
 
 #include "Style.h"
+#include "GlyphCache.h"
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
+#include <thread>
 
 
 class FontSet {
@@ -14,9 +16,20 @@ class FontSet {
 		~FontSet();
 
 		XftFont* xft_font_for(const Style& style) {
-			return xft_fonts[style.italic << 1 | style.bold];
+			int which = style.italic << 1 | style.bold;
+			if (xft_fonts[which] == nullptr)
+				open_style(which);
+			return xft_fonts[which];
 			}
 		XftFont* plain_xft_font() { return xft_fonts[0]; }
+		GlyphCache* glyph_cache_for(const Style& style) {
+			int which = style.italic << 1 | style.bold;
+			if (glyph_caches[which] == nullptr)
+				open_style(which);
+			return glyph_caches[which];
+			}
+		GlyphCache* plain_glyph_cache() { return glyph_caches[0]; }
+		void	save_metrics();
 		int	ascent() { return xft_fonts[0]->ascent; }
 		int height() { return xft_fonts[0]->height; }
 
@@ -24,7 +37,21 @@ class FontSet {
 
 	protected:
 		Display* display;
-		XftFont* xft_fonts[4];
+		bool skip_italics;
+		XftFont* xft_fonts[4]; 	// Only the plain one is opened right away.
+		GlyphCache* glyph_caches[4];
+
+		// The other styles may never be used, and we don't need them right away,
+		// so fontconfig matches them on a helper thread and they're only opened
+		// when first used.  The patterns are fully substituted already (Xft's
+		// substitutions need the display); the keys are what the disk cache
+		// knows them by.
+		FcPattern* style_patterns[4];
+		FcPattern* style_keys[4];
+		FcPattern* style_matches[4];
+		std::thread matcher;
+
+		void	open_style(int which);
 	};
 
 
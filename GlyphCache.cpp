@@ -0,0 +1,163 @@
+#include "GlyphCache.h"
+#include "UTF8.h"
+#include "DiskCache.h"
+
+
+GlyphCache::GlyphCache(Display* display_in, XftFont* xft_font_in)
+	: display(display_in), xft_font(xft_font_in),
+	fallback_patterns(nullptr), fallbacks_sorted(false)
+{
+	DiskCache::GlyphMetrics metrics[num_dense_chars];
+	bool have_metrics =
+		DiskCache::load_glyph_metrics(xft_font->pattern, metrics, num_dense_chars);
+	for (int i = 0; i < num_dense_chars; ++i) {
+		dense_glyphs[i].font = xft_font;
+		dense_glyphs[i].index = (have_metrics ? metrics[i].index : 0);
+		dense_glyphs[i].advance = (have_metrics ? metrics[i].advance : -1);
+		dense_fallbacks[i] = (have_metrics ? metrics[i].fallback : 0);
+		if (dense_fallbacks[i] != 0)
+			dense_glyphs[i].font = nullptr;
+		}
+	dense_glyphs_changed = false;
+}
+
+
+GlyphCache::~GlyphCache()
+{
+	save_metrics();
+
+	for (auto font: fallback_fonts) {
+		if (font)
+			XftFontClose(display, font);
+		}
+	if (fallback_patterns)
+		FcFontSetDestroy(fallback_patterns);
+}
+
+
+void GlyphCache::save_metrics()
+{
+	if (!dense_glyphs_changed)
+		return;
+
+	DiskCache::GlyphMetrics metrics[num_dense_chars];
+	for (int i = 0; i < num_dense_chars; ++i) {
+		const Glyph& glyph = dense_glyphs[i];
+		bool known = glyph.advance >= 0;
+		metrics[i].index = (known ? glyph.index : 0);
+		metrics[i].advance = (known ? glyph.advance : -1);
+		metrics[i].fallback = (known ? dense_fallbacks[i] : 0);
+		}
+	DiskCache::save_glyph_metrics(xft_font->pattern, metrics, num_dense_chars);
+	dense_glyphs_changed = false;
+}
+
+
+int GlyphCache::text_width(const char* bytes, int length)
+{
+	const char* p = bytes;
+	const char* end = bytes + length;
+	int width = 0;
+	while (p < end)
+		width += advance(UTF8::decode(p, end));
+	return width;
+}
+
+
+const GlyphCache::Glyph& GlyphCache::lookup_glyph(uint32_t c)
+{
+	if (c < num_dense_chars) {
+		Glyph* glyph = &dense_glyphs[c];
+		if (glyph->advance >= 0 && glyph->font == nullptr) {
+			// It's from a fallback the DiskCache told us about; open it now.
+			glyph->font = fallback_font(dense_fallbacks[c] - 1);
+			if (glyph->font)
+				return *glyph;
+			}
+		load_glyph(c, glyph, &dense_fallbacks[c]);
+		dense_glyphs_changed = true;
+		return *glyph;
+		}
+
+	auto found = sparse_glyphs.find(c);
+	if (found != sparse_glyphs.end())
+		return found->second;
+	Glyph& glyph = sparse_glyphs[c];
+	load_glyph(c, &glyph);
+	return glyph;
+}
+
+
+void GlyphCache::load_glyph(uint32_t c, Glyph* glyph, int* fallback_out)
+{
+	glyph->font = xft_font;
+	int fallback = -1;
+	if (!XftCharExists(display, xft_font, c)) {
+		fallback = fallback_for(c);
+		if (fallback >= 0)
+			glyph->font = fallback_font(fallback);
+		// Otherwise, we'll use the font's "missing glyph" glyph.
+		}
+	if (fallback_out)
+		*fallback_out = fallback + 1;
+
+	glyph->index = XftCharIndex(display, glyph->font, c);
+	XGlyphInfo glyph_info;
+	XftGlyphExtents(display, glyph->font, &glyph->index, 1, &glyph_info);
+	glyph->advance = glyph_info.xOff;
+}
+
+
+void GlyphCache::sort_fallbacks()
+{
+	if (fallbacks_sorted)
+		return;
+	FcResult result;
+	fallback_patterns = FcFontSort(nullptr, xft_font->pattern, FcTrue, nullptr, &result);
+	if (fallback_patterns)
+		fallback_fonts.assign(fallback_patterns->nfont, nullptr);
+	fallbacks_sorted = true;
+}
+
+
+int GlyphCache::fallback_for(uint32_t c)
+{
+	// Returns the fallback's place in "fallback_patterns", or -1 if none of them
+	// have it (or it couldn't be opened).
+	sort_fallbacks();
+	if (fallback_patterns == nullptr)
+		return -1;
+
+	for (int i = 0; i < fallback_patterns->nfont; ++i) {
+		FcCharSet* charset = nullptr;
+		FcResult result =
+			FcPatternGetCharSet(fallback_patterns->fonts[i], FC_CHARSET, 0, &charset);
+		if (result != FcResultMatch || !FcCharSetHasChar(charset, c))
+			continue;
+		if (fallback_font(i))
+			return i;
+		}
+
+	return -1;
+}
+
+
+XftFont* GlyphCache::fallback_font(int which)
+{
+	// Opens it (at the same size as the font) if we haven't yet.
+	sort_fallbacks();
+	if (fallback_patterns == nullptr || which < 0 || which >= fallback_patterns->nfont)
+		return nullptr;
+	if (fallback_fonts[which] == nullptr) {
+		FcPattern* pattern =
+			FcFontRenderPrepare(nullptr, xft_font->pattern, fallback_patterns->fonts[which]);
+		if (pattern == nullptr)
+			return nullptr;
+		fallback_fonts[which] = XftFontOpenPattern(display, pattern);
+		if (fallback_fonts[which] == nullptr)
+			FcPatternDestroy(pattern);
+		}
+	return fallback_fonts[which];
+}
+
+
@@ -0,0 +1,81 @@
+#ifndef GlyphCache_h
+#define GlyphCache_h
+
+#include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+// Caches the glyph index and advance width of the characters in one font, so
+// measuring and drawing text doesn't need to ask Xft about every string.  Xft
+// doesn't kern, so the width of a string is just the sum of the advances of
+// its characters.
+//
+// Characters the font doesn't have come from fallback fonts.  Those are found
+// through fontconfig the first time each such character is used; after that,
+// the cache remembers which font it came from.
+//
+// The metrics of ASCII and Latin characters (including which fallback they
+// came from) are also kept in the DiskCache between runs.
+
+
+class GlyphCache {
+	public:
+		GlyphCache(Display* display, XftFont* xft_font);
+		~GlyphCache();
+
+		struct Glyph {
+			XftFont*	font; 	// The font itself, or a fallback.
+			FT_UInt	index;
+			int	advance; 	// -1: not looked up yet.
+			};
+
+		const Glyph&	glyph(uint32_t c) {
+			if (c < num_dense_chars && dense_glyphs[c].advance >= 0 && dense_glyphs[c].font)
+				return dense_glyphs[c];
+			return lookup_glyph(c);
+			}
+		int	advance(uint32_t c) {
+			// Fallback fonts from the DiskCache aren't opened just to measure.
+			if (c < num_dense_chars && dense_glyphs[c].advance >= 0)
+				return dense_glyphs[c].advance;
+			return lookup_glyph(c).advance;
+			}
+		int	text_width(const char* bytes, int length);
+
+		void	save_metrics();
+			// If they've changed.  Also done when it's destroyed.
+
+	protected:
+		enum {
+			num_dense_chars = 0x250, 	// ASCII and Latin.
+			};
+
+		Display*	display;
+		XftFont*	xft_font;
+		Glyph	dense_glyphs[num_dense_chars];
+			// "font" is nullptr if it's a fallback that hasn't been opened yet.
+		int	dense_fallbacks[num_dense_chars];
+			// 0: the font itself; otherwise, 1 + the fallback's place in
+			// "fallback_patterns".
+		bool	dense_glyphs_changed; 	// Since they were loaded from the DiskCache.
+		std::unordered_map<uint32_t, Glyph>	sparse_glyphs;
+
+		// Fallbacks.  Fontconfig's list of fonts (best match first) is only
+		// fetched when we first need it, and the fonts in it are only opened when
+		// a character is found in them.
+		FcFontSet*	fallback_patterns;
+		bool	fallbacks_sorted;
+		std::vector<XftFont*>	fallback_fonts; 	// nullptr: not opened yet.
+
+		const Glyph&	lookup_glyph(uint32_t c);
+		void	load_glyph(uint32_t c, Glyph* glyph, int* fallback_out = nullptr);
+		int	fallback_for(uint32_t c);
+		XftFont*	fallback_font(int which);
+		void	sort_fallbacks();
+	};
+
+
+#endif 	// !GlyphCache_h
+
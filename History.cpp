@@ -13,7 +13,8 @@
 
 History::History() :
 	cursor_enabled(true), use_bracketed_paste(false),
-	application_cursor_keys(false),
+	application_cursor_keys(false), synchronized_output(false),
+	cursor_shape(BlockCursor), cursor_blinks(false),
 	terminal(nullptr)
 {
 	at_end_of_line = true;
@@ -242,18 +243,10 @@ int History::add_input(const char* input, int length)
 			case '\t':
 				{
 				Line* cur_line = line(current_line);
-				if (at_end_of_line) {
+				if (at_end_of_line)
 					cur_line->append_tab(current_style);
-					// Just need to make sure "current_elastic_tabs" gets enough
-					// columns.
-					characters_added();
-					}
-				else {
+				else
 					cur_line->replace_character_with_tab(current_column, current_style);
-					// Could be splitting a column.  Trigger a full recalculation of
-					// the columns.
-					characters_deleted();
-					}
 				}
 				break;
 
@@ -336,7 +329,6 @@ void History::add_to_current_line(const char* start, const char* end)
 			current_column, start, end - start, current_style);
 		}
 	current_column += UTF8::num_characters(start, end - start);
-	characters_added();
 	if (!at_end_of_line)
 		update_at_end_of_line();
 }
@@ -357,12 +349,7 @@ void History::next_line()
 		new_line();
 	else {
 		current_line += 1;
-		Line* cur_line = line(current_line);
-		if (cur_line->elastic_tabs)
-			cur_line->elastic_tabs->release();
-		cur_line->elastic_tabs = current_elastic_tabs;
-		if (current_elastic_tabs)
-			current_elastic_tabs->acquire();
+		line(current_line)->set_elastic_tabs(current_elastic_tabs);
 		update_at_end_of_line();
 		}
 }
@@ -372,9 +359,7 @@ void History::new_line()
 {
 	allocate_new_line();
 	current_line = last_line;
-	line(current_line)->elastic_tabs = current_elastic_tabs;
-	if (current_elastic_tabs)
-		current_elastic_tabs->acquire();
+	line(current_line)->set_elastic_tabs(current_elastic_tabs);
 	at_end_of_line = true;
 }
 
@@ -454,13 +439,17 @@ const char* History::parse_csi(const char* p, const char* end)
 		return nullptr;
 
 	// "Intermediate bytes".
-	// We ignore these.
+	// Only a few sequences use these, and none use more than one, so we just
+	// keep the last one.
+	char intermediate = 0;
 	while (true) {
 		if (p >= end)
 			return nullptr;
 		c = *p;
-		if (c >= 0x20 && c <= 0x2F)
+		if (c >= 0x20 && c <= 0x2F) {
+			intermediate = c;
 			p += 1;
+			}
 		else
 			break;
 		}
@@ -479,7 +468,6 @@ const char* History::parse_csi(const char* p, const char* end)
 			line(current_line)->insert_characters(
 				current_column, blanks.data(), num_blanks, current_style);
 			at_end_of_line = false;
-			characters_added();
 			}
 			break;
 
@@ -586,7 +574,6 @@ const char* History::parse_csi(const char* p, const char* end)
 					cur_line->prepend_spaces(current_column, current_style);
 				at_end_of_line = true;
 				}
-			characters_deleted();
 			}
 			break;
 
@@ -604,7 +591,6 @@ const char* History::parse_csi(const char* p, const char* end)
 			// Delete Character (DCH).
 			line(current_line)->delete_characters(current_column, args.args[0] ? args.args[0] : 1);
 			update_at_end_of_line();
-			characters_deleted();
 			break;
 
 		case 'S':
@@ -638,7 +624,6 @@ const char* History::parse_csi(const char* p, const char* end)
 			line(current_line)->replace_characters(
 				current_column, blanks.data(), num_blanks, current_style);
 			at_end_of_line = false;
-			characters_deleted();
 			}
 			break;
 
@@ -812,6 +797,24 @@ const char* History::parse_csi(const char* p, const char* end)
 				goto unimplemented;
 			break;
 
+		case 'q':
+			if (intermediate == ' ') {
+				// Set cursor style (DECSCUSR).
+				int cursor_style = args.args[0];
+				if (cursor_style > 6)
+					goto unimplemented;
+				static const int cursor_shapes[] = {
+					BlockCursor, BlockCursor, BlockCursor,
+					UnderlineCursor, UnderlineCursor, BarCursor, BarCursor,
+					};
+				cursor_shape = cursor_shapes[cursor_style];
+				// Odd styles blink; zero is our default (a steady block).
+				cursor_blinks = (cursor_style % 2) == 1;
+				}
+			else
+				goto unimplemented;
+			break;
+
 		case 'r':
 			// Set scroll margins (DECSTBM).
 			top_margin = args.args[0] ? args.args[0] - 1 : 0;
@@ -847,7 +850,17 @@ const char* History::parse_csi(const char* p, const char* end)
 				set_private_modes(&args, false);
 				break;
 
+			case 'p':
+				if (intermediate == '$') {
+					// Request Mode (DECRQM).
+					report_private_mode(args.args[0]);
+					}
+				else
+					goto unimplemented_private;
+				break;
+
 			default:
+			unimplemented_private:
 				// This is either unimplemented or invalid.
 #ifdef PRINT_UNIMPLEMENTED_ESCAPES
 				printf("- Unimplemented CSI: %.*s\n", (int) (p - escape_start), escape_start);
@@ -955,7 +968,7 @@ void History::set_private_modes(Arguments* args, bool set)
 
 			case 12:
 				// Cursor blinking.
-				// We don't support this currently, so we're ignoring it.
+				cursor_blinks = set;
 				break;
 
 			case 25:
@@ -975,6 +988,15 @@ void History::set_private_modes(Arguments* args, bool set)
 				use_bracketed_paste = set;
 				break;
 
+			case 2026:
+				// Synchronized output.  The window holds off on drawing while this
+				// is set.
+				if (set != synchronized_output) {
+					synchronized_output = set;
+					window->synchronized_output_changed();
+					}
+				break;
+
 			case 5001:
 				if (set)
 					start_elastic_tabs();
@@ -996,6 +1018,42 @@ void History::set_private_modes(Arguments* args, bool set)
 }
 
 
+void History::report_private_mode(int mode)
+{
+	enum {
+		not_recognized = 0, is_set = 1, is_reset = 2,
+		};
+	int state = not_recognized;
+	switch (mode) {
+		case 1:
+			state = application_cursor_keys ? is_set : is_reset;
+			break;
+		case 7:
+			state = auto_wrap ? is_set : is_reset;
+			break;
+		case 12:
+			state = cursor_blinks ? is_set : is_reset;
+			break;
+		case 25:
+			state = cursor_enabled ? is_set : is_reset;
+			break;
+		case 1049:
+			state = is_in_alternate_screen() ? is_set : is_reset;
+			break;
+		case 2004:
+			state = use_bracketed_paste ? is_set : is_reset;
+			break;
+		case 2026:
+			state = synchronized_output ? is_set : is_reset;
+			break;
+		}
+
+	char report[32];
+	sprintf(report, "\x1B[?%d;%d$y", mode, state);
+	terminal->send(report);
+}
+
+
 int64_t History::calc_screen_top_line()
 {
 	int screen_top_line = last_line - lines_on_screen + 1;
@@ -1070,6 +1128,7 @@ void History::scroll_down(int num_lines, int64_t top_scroll_line)
 			lines[src_index] = new Line();
 			}
 		}
+	window->lines_scrolled(top_scroll_line, bottom_scroll_line, -num_lines);
 
 	update_at_end_of_line();
 }
@@ -1114,6 +1173,7 @@ void History::scroll_up(int64_t top_scroll_line, int64_t bottom_scroll_line, int
 			lines[src_index] = new Line();
 			}
 		}
+	window->lines_scrolled(top_scroll_line, bottom_scroll_line, num_lines);
 }
 
 
@@ -1172,11 +1232,7 @@ void History::start_elastic_tabs(int num_right_columns)
 
 	current_elastic_tabs = new ElasticTabs(num_right_columns);
 	current_elastic_tabs->acquire();
-	Line* cur_line = line(current_line);
-	if (cur_line->elastic_tabs)
-		cur_line->elastic_tabs->release();
-	cur_line->elastic_tabs = current_elastic_tabs;
-	current_elastic_tabs->acquire();
+	line(current_line)->set_elastic_tabs(current_elastic_tabs);
 }
 
 
@@ -1189,37 +1245,14 @@ void History::end_elastic_tabs(bool include_current_line)
 	// lines (unless include_current_line is true).
 	if (!include_current_line) {
 		Line* cur_line = line(current_line);
-		if (cur_line->elastic_tabs == current_elastic_tabs) {
-			current_elastic_tabs->release();
-			cur_line->elastic_tabs = nullptr;
-			}
+		if (cur_line->elastic_tabs == current_elastic_tabs)
+			cur_line->set_elastic_tabs(nullptr);
 		}
 	current_elastic_tabs->release();
 	current_elastic_tabs = nullptr;
 }
 
 
-void History::characters_added()
-{
-	if (current_elastic_tabs == nullptr)
-		return;
-
-	current_elastic_tabs->is_dirty = true;
-	if (current_line < current_elastic_tabs->first_dirty_line)
-		current_elastic_tabs->first_dirty_line = current_line;
-}
-
-
-void History::characters_deleted()
-{
-	if (current_elastic_tabs == nullptr)
-		return;
-
-	current_elastic_tabs->is_dirty = true;
-	current_elastic_tabs->first_dirty_line = 0;
-}
-
-
 const char* History::Arguments::parse(const char* p, const char* end)
 {
 	char c;
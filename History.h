@@ -40,6 +40,12 @@ class History {
 		bool	cursor_enabled;
 		bool	use_bracketed_paste;
 		bool	application_cursor_keys;
+		bool	synchronized_output;
+		enum {
+			BlockCursor, UnderlineCursor, BarCursor,
+			};
+		int	cursor_shape;
+		bool	cursor_blinks;
 
 	protected:
 		Style	current_style;
@@ -95,6 +101,7 @@ class History {
 		const char*	parse_osc(const char* p, const char* end);
 		const char*	parse_st_string(const char* p, const char* end, bool can_end_with_bel = false);
 		void	set_private_modes(Arguments* args, bool set);
+		void	report_private_mode(int mode);
 
 		int64_t	calc_screen_top_line();
 		int64_t	calc_screen_bottom_line();
@@ -112,8 +119,6 @@ class History {
 
 		void	start_elastic_tabs(int num_right_columns = 0);
 		void	end_elastic_tabs(bool include_current_line = false);
-		void	characters_added();
-		void	characters_deleted();
 		ElasticTabs* current_elastic_tabs;
 
 		std::string	translate_line_drawing_chars(const char* start, const char* end);
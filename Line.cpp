@@ -7,9 +7,13 @@
 #include <assert.h>
 
 
+static uint64_t last_version = 0;
+
+
 Line::Line()
-	: elastic_tabs(nullptr)
+	: elastic_tabs(nullptr), elastic_widths_font_generation(0)
 {
+	changed();
 }
 
 
@@ -17,8 +21,23 @@ Line::~Line()
 {
 	for (auto& run: runs)
 		delete run;
-	if (elastic_tabs)
+	set_elastic_tabs(nullptr);
+}
+
+
+void Line::set_elastic_tabs(ElasticTabs* new_elastic_tabs)
+{
+	if (new_elastic_tabs == elastic_tabs)
+		return;
+	if (elastic_tabs) {
+		elastic_tabs->remove_line(this);
 		elastic_tabs->release();
+		}
+	elastic_tabs = new_elastic_tabs;
+	if (elastic_tabs) {
+		elastic_tabs->acquire();
+		elastic_tabs->line_changed(this);
+		}
 }
 
 
@@ -32,11 +51,13 @@ void Line::append_characters(const char* bytes, int length, Style style)
 	else
 		last_run = runs.back();
 	last_run->append_characters(bytes, length);
+	changed();
 }
 
 
 void Line::replace_characters(int column, const char* bytes, int length, Style style)
 {
+	changed();
 	if (runs.empty()) {
 		Run* run = new Run(style);
 		run->append_characters(bytes, length);
@@ -117,6 +138,7 @@ void Line::replace_characters(int column, const char* bytes, int length, Style s
 
 void Line::insert_characters(int column, const char* bytes, int length, Style style)
 {
+	changed();
 	if (runs.empty()) {
 		Run* run = new Run(style);
 		run->append_characters(bytes, length);
@@ -162,6 +184,7 @@ void Line::append_tab(Style style)
 	Run* run = new Run(strdup("\t"), style);
 	run->is_tab = true;
 	runs.push_back(run);
+	changed();
 }
 
 
@@ -169,6 +192,7 @@ void Line::replace_character_with_tab(int column, Style style)
 {
 	Run* tab_run = new Run(strdup("\t"), style);
 	tab_run->is_tab = true;
+	changed();
 
 	if (runs.empty()) {
 		runs.push_back(tab_run);
@@ -227,6 +251,7 @@ void Line::clear()
 	for (auto& run: runs)
 		delete run;
 	runs.clear();
+	changed();
 }
 
 
@@ -315,6 +340,7 @@ void Line::clear_to_end_from(int column)
 			}
 		}
 	runs.erase(first_to_delete, runs.end());
+	changed();
 }
 
 
@@ -335,6 +361,7 @@ void Line::clear_from_beginning_to(int column)
 			}
 		column -= run_num_chars;
 		}
+	changed();
 }
 
 
@@ -348,6 +375,7 @@ void Line::prepend_spaces(int num_spaces, Style style)
 		spaces[i] = ' ';
 	spaces[num_spaces] = 0;
 	runs.push_front(new Run(spaces, style));
+	changed();
 }
 
 
@@ -362,6 +390,7 @@ void Line::append_spaces(int num_spaces, Style style)
 		spaces[num_spaces] = 0;
 		runs.push_back(new Run(spaces, style));
 		}
+	changed();
 }
 
 
@@ -405,6 +434,15 @@ void Line::delete_characters(int column, int num_chars)
 			column -= run_num_chars;
 		}
 	runs.erase(first_to_delete, deleted_runs_end);
+	changed();
+}
+
+
+void Line::changed()
+{
+	version = ++last_version;
+	if (elastic_tabs)
+		elastic_tabs->line_changed(this);
 }
 
 
@@ -3,8 +3,11 @@
 
 #include "Style.h"
 #include "ElasticTabs.h"
+#include "LineLayout.h"
 #include <list>
 #include <string>
+#include <vector>
+#include <stdint.h>
 
 class Run;
 
@@ -15,6 +18,18 @@ class Line {
 		~Line();
 
 		ElasticTabs* elastic_tabs;
+		std::vector<int>	elastic_widths;
+		uint64_t	elastic_widths_font_generation;
+			// What this line contributes to its elastic tabs' column widths, and
+			// the fonts it was measured with.
+		void	set_elastic_tabs(ElasticTabs* new_elastic_tabs);
+
+		// Every change to the line gives it a new version, unique across all
+		// lines, so the window can tell whether what it drew is still current.
+		uint64_t	version;
+
+		// The TermWindow keeps the line's layout here.
+		LineLayout	layout;
 
 		void	append_characters(const char* bytes, int length, Style style);
 		void	replace_characters(int column, const char* bytes, int length, Style style);
@@ -24,10 +39,7 @@ class Line {
 		void	clear();
 		void	fully_clear() {
 			clear();
-			if (elastic_tabs) {
-				elastic_tabs->release();
-				elastic_tabs = nullptr;
-				}
+			set_elastic_tabs(nullptr);
 			}
 		bool	empty()  {
 			return runs.empty();
@@ -49,6 +61,7 @@ class Line {
 	protected:
 		std::list<Run*>	runs;
 
+		void	changed();
 		void	split_run_at(std::list<Run*>::iterator run_to_split, int column);
 	};
 
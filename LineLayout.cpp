@@ -0,0 +1,31 @@
+#include "LineLayout.h"
+
+
+int LineLayout::column_for_x(int x_in)
+{
+	if (uniform) {
+		int column = (x_in + monospace_width - monospace_width / 2) / monospace_width;
+		if (column < 0)
+			column = 0;
+		else if (column > num_columns())
+			column = num_columns();
+		return column;
+		}
+
+	// A point in the left half of a column is in that column; a point in the
+	// right half is in the next one.  Because the columns are in order, we can
+	// binary-search for it.
+	int low = 0;
+	int high = num_columns();
+	while (low < high) {
+		int column = (low + high) / 2;
+		int column_width = x[column + 1] - x[column];
+		if (x_in - x[column] < column_width / 2)
+			high = column;
+		else
+			low = column + 1;
+		}
+	return low;
+}
+
+
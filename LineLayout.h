@@ -0,0 +1,68 @@
+#ifndef LineLayout_h
+#define LineLayout_h
+
+#include <vector>
+#include <stdint.h>
+
+class ElasticTabs;
+
+// Where everything in a Line goes horizontally.  The TermWindow fills it in;
+// it's cached on the Line so drawing, hit-testing, and elastic tabs can all
+// share it, and so it only needs to be recalculated when something it depends
+// on changes.
+
+
+class LineLayout {
+	public:
+		LineLayout()
+			: line_version(0), font_generation(0), initial_spaces(0), monospace_width(0),
+			elastic_tabs(nullptr), elastic_tabs_generation(0), window_width(-1),
+			uniform(false), trimmed(false)
+			{}
+
+		// Measurement.  This depends only on the line's contents and the fonts.
+		struct Cell {
+			int	advance; 	// For tabs, the width of a space.
+			bool	is_tab;
+			};
+		uint64_t	line_version, font_generation;
+		std::vector<Cell>	cells;
+		std::vector<int>	segment_widths;
+			// The width of the text before each tab, and after the last one.  These
+			// are what elastic tabs need.
+		int	initial_spaces;
+		int	monospace_width;
+			// Nonzero if the line was measured with the monospace font, in which
+			// case it's the width of every character.
+
+		// Positions.  These also depend on the elastic tabs and the window width.
+		ElasticTabs*	elastic_tabs;
+		uint64_t	elastic_tabs_generation;
+		int	window_width;
+		std::vector<int>	x;
+			// The left edge of each column (relative to the border), with the end of
+			// the line at the end.
+		bool	uniform;
+			// True if every column is "monospace_width" wide (no tabs get in the
+			// way), so positions are just arithmetic.
+
+		int	num_columns() { return cells.size(); }
+		int	column_for_x(int x);
+		void	invalidate_positions() { window_width = -1; }
+
+		// The cells and positions take several bytes per character, so lines
+		// that aren't being shown only keep what elastic tabs need
+		// ("segment_widths" and "initial_spaces").  The rest is measured again
+		// if the line is shown again.
+		bool	trimmed;
+		void	trim() {
+			std::vector<Cell>().swap(cells);
+			std::vector<int>().swap(x);
+			trimmed = true;
+			invalidate_positions();
+			}
+	};
+
+
+#endif 	// !LineLayout_h
+
@@ -0,0 +1,86 @@
+#include "LineTileCache.h"
+#include "Settings.h"
+
+
+LineTileCache::~LineTileCache()
+{
+	clear();
+	if (tile_width > 0)
+		XFreeGC(display, gc);
+}
+
+
+void LineTileCache::set_tile_size(Drawable drawable_in, int width, int height, int depth_in)
+{
+	// The drawable is only used to say which screen new tiles go on, so it can
+	// change without losing the tiles.
+	drawable = drawable_in;
+	if (width == tile_width && height == tile_height && depth_in == depth)
+		return;
+	clear();
+	if (tile_width == 0) {
+		XGCValues gc_values;
+		gc_values.graphics_exposures = False;
+		gc = XCreateGC(display, drawable_in, GCGraphicsExposures, &gc_values);
+		}
+	tile_width = width;
+	tile_height = height;
+	depth = depth_in;
+
+	// Figure out how many tiles we can keep.  Assume they take four bytes per
+	// pixel on the server.
+	size_t tile_bytes = (size_t) width * height * 4;
+	max_tiles = 0;
+	if (tile_bytes > 0)
+		max_tiles = ((size_t) settings.line_cache_megabytes << 20) / tile_bytes;
+}
+
+
+void LineTileCache::clear()
+{
+	for (auto& tile: tiles)
+		XFreePixmap(display, tile.pixmap);
+	tiles.clear();
+	tiles_by_key.clear();
+}
+
+
+Pixmap LineTileCache::get(
+	uint64_t line_version, uint64_t elastic_tabs_generation,
+	uint64_t font_generation)
+{
+	Key key = { line_version, elastic_tabs_generation, font_generation };
+	auto found = tiles_by_key.find(key);
+	if (found == tiles_by_key.end())
+		return None;
+
+	// Move it to the front.
+	tiles.splice(tiles.begin(), tiles, found->second);
+	return found->second->pixmap;
+}
+
+
+void LineTileCache::add(
+	uint64_t line_version, uint64_t elastic_tabs_generation,
+	uint64_t font_generation, Drawable source, int y)
+{
+	if (max_tiles == 0)
+		return;
+
+	// Reuse the least recently used tile if we're full.
+	Tile tile;
+	tile.key = { line_version, elastic_tabs_generation, font_generation };
+	if (tiles.size() >= max_tiles) {
+		tile.pixmap = tiles.back().pixmap;
+		tiles_by_key.erase(tiles.back().key);
+		tiles.pop_back();
+		}
+	else
+		tile.pixmap = XCreatePixmap(display, drawable, tile_width, tile_height, depth);
+
+	XCopyArea(display, source, tile.pixmap, gc, 0, y, tile_width, tile_height, 0, 0);
+	tiles.push_front(tile);
+	tiles_by_key[tile.key] = tiles.begin();
+}
+
+
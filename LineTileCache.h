@@ -0,0 +1,72 @@
+#ifndef LineTileCache_h
+#define LineTileCache_h
+
+#include <X11/Xlib.h>
+#include <list>
+#include <unordered_map>
+#include <stdint.h>
+
+// Keeps rendered copies of lines from the history, so scrolling back and forth
+// through it can just copy them into place instead of drawing them again.
+// Tiles are a whole row of the window; the least recently used ones are thrown
+// away when they'd take more than "settings.line_cache_megabytes".
+//
+// A tile is keyed by the line's version and its elastic tabs' generation,
+// which are unique across all lines, and by the window's font generation, so
+// a tile can never be used for anything but the exact line it was drawn from,
+// drawn with the same fonts.  The window width and row height are the tile
+// size; changing that clears the cache.
+
+
+class LineTileCache {
+	public:
+		LineTileCache(Display* display_in)
+			: display(display_in), drawable(None), tile_width(0), tile_height(0),
+			depth(0), max_tiles(0) {}
+		~LineTileCache();
+
+		void	set_tile_size(Drawable drawable, int width, int height, int depth);
+		void	clear();
+
+		Pixmap	get(
+			uint64_t line_version, uint64_t elastic_tabs_generation,
+			uint64_t font_generation);
+		void	add(
+			uint64_t line_version, uint64_t elastic_tabs_generation,
+			uint64_t font_generation, Drawable source, int y);
+		bool	enabled() { return max_tiles > 0; }
+
+	protected:
+		struct Key {
+			uint64_t	line_version, elastic_tabs_generation, font_generation;
+			bool	operator==(const Key& other) const {
+				return
+					line_version == other.line_version &&
+					elastic_tabs_generation == other.elastic_tabs_generation &&
+					font_generation == other.font_generation;
+				}
+			};
+		struct KeyHash {
+			size_t	operator()(const Key& key) const {
+				return
+					(key.line_version * 31 + key.elastic_tabs_generation) * 31 +
+					key.font_generation;
+				}
+			};
+		struct Tile {
+			Key	key;
+			Pixmap	pixmap;
+			};
+
+		Display*	display;
+		Drawable	drawable;
+		int	tile_width, tile_height, depth;
+		size_t	max_tiles;
+		GC	gc;
+		std::list<Tile>	tiles; 	// Most recently used first.
+		std::unordered_map<Key, std::list<Tile>::iterator, KeyHash>	tiles_by_key;
+	};
+
+
+#endif 	// !LineTileCache_h
+
@@ -0,0 +1,125 @@
+#include "Presenter.h"
+#ifdef USE_PRESENT
+#include <X11/extensions/Xpresent.h>
+#include <X11/extensions/Xfixes.h>
+#include <time.h>
+#endif
+
+
+#ifdef USE_PRESENT
+static uint64_t monotonic_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+#endif
+
+
+Presenter::Presenter(Display* display_in, Window window_in, GC gc_in)
+	: display(display_in), window(window_in), gc(gc_in)
+{
+#ifdef USE_PRESENT
+	use_present = false;
+	present_event_id = 0;
+	serial = 0;
+	frame_in_flight = false;
+	frame_start_ms = 0;
+
+	int event_base, error_base, major = 1, minor = 0;
+	bool have_present =
+		XPresentQueryExtension(display, &present_opcode, &event_base, &error_base) &&
+		XPresentQueryVersion(display, &major, &minor);
+	if (have_present) {
+		present_event_id =
+			XPresentSelectInput(display, window, PresentCompleteNotifyMask);
+		use_present = true;
+		}
+#endif
+}
+
+
+Presenter::~Presenter()
+{
+#ifdef USE_PRESENT
+	if (use_present)
+		XPresentFreeInput(display, window, present_event_id);
+#endif
+}
+
+
+void Presenter::present(Pixmap pixmap, std::vector<XRectangle>& damage)
+{
+	if (damage.empty())
+		return;
+
+#ifdef USE_PRESENT
+	if (use_present) {
+		XserverRegion update = XFixesCreateRegion(display, damage.data(), damage.size());
+		XPresentPixmap(
+			display, window, pixmap, ++serial,
+			None, update, 0, 0, None, None, None,
+			PresentOptionCopy, 0, 0, 0, nullptr, 0);
+		XFixesDestroyRegion(display, update);
+		XFlush(display);
+		frame_in_flight = true;
+		frame_start_ms = monotonic_ms();
+		return;
+		}
+#endif
+
+	for (auto& rect: damage) {
+		XCopyArea(
+			display, pixmap, window, gc,
+			rect.x, rect.y, rect.width, rect.height, rect.x, rect.y);
+		}
+	XFlush(display);
+}
+
+
+bool Presenter::ready()
+{
+#ifdef USE_PRESENT
+	if (frame_in_flight && monotonic_ms() - frame_start_ms >= max_frame_wait_ms)
+		frame_in_flight = false;
+	return !frame_in_flight;
+#else
+	return true;
+#endif
+}
+
+
+uint64_t Presenter::ms_until_ready()
+{
+#ifdef USE_PRESENT
+	uint64_t elapsed_ms = monotonic_ms() - frame_start_ms;
+	if (!frame_in_flight || elapsed_ms >= max_frame_wait_ms)
+		return 0;
+	return max_frame_wait_ms - elapsed_ms;
+#else
+	return 0;
+#endif
+}
+
+
+bool Presenter::handle_event(XEvent* event)
+{
+#ifdef USE_PRESENT
+	if (!use_present || event->type != GenericEvent || event->xcookie.extension != present_opcode)
+		return false;
+	if (XGetEventData(display, &event->xcookie)) {
+		if (event->xcookie.evtype == PresentCompleteNotify) {
+			XPresentCompleteNotifyEvent* complete =
+				(XPresentCompleteNotifyEvent*) event->xcookie.data;
+			if (complete->kind == PresentCompleteKindPixmap && complete->serial_number == serial)
+				frame_in_flight = false;
+			}
+		XFreeEventData(display, &event->xcookie);
+		}
+	return true;
+#else
+	return false;
+#endif
+}
+
+
@@ -0,0 +1,57 @@
+#ifndef Presenter_h
+#define Presenter_h
+
+#include <X11/Xlib.h>
+#include <vector>
+#include <stdint.h>
+
+// Gets the damaged parts of the pixmap onto the window.
+//
+// Normally that's just XCopyArea().  If spft is built with the USE_PRESENT
+// switch and the server has the Present extension, the copy happens at the
+// next vertical blank instead, and we hold off on drawing the next frame
+// until the server says this one is done.  That paces us to the display
+// instead of drawing frames nobody will see.
+
+
+class Presenter {
+	public:
+		Presenter(Display* display, Window window, GC gc);
+		~Presenter();
+
+		void	present(Pixmap pixmap, std::vector<XRectangle>& damage);
+
+		// Whether we can draw the next frame, or if the last one is still in
+		// flight.
+		bool	ready();
+
+		// How long (in milliseconds) until we'll stop waiting for the last
+		// frame.  Only meaningful if not ready().
+		uint64_t	ms_until_ready();
+
+		// Returns true if the event was ours.
+		bool	handle_event(XEvent* event);
+
+	protected:
+		Display*	display;
+		Window	window;
+		GC	gc;
+
+#ifdef USE_PRESENT
+		enum {
+			// If the server doesn't tell us a frame is done by then (say, because
+			// the window isn't visible), go ahead anyway.
+			max_frame_wait_ms = 100,
+			};
+		bool	use_present;
+		int	present_opcode;
+		XID	present_event_id;
+		uint32_t	serial;
+		bool	frame_in_flight;
+		uint64_t	frame_start_ms;
+#endif
+	};
+
+
+#endif 	// !Presenter_h
+
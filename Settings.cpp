@@ -29,6 +29,13 @@ Settings settings = {
 	.border = 0,
 	.default_auto_wrap = true,
 	.font_size_increment = 0.5,
+	.wheel_scroll_lines = 3,
+	.max_frames_per_second = 60,
+	.line_cache_megabytes = 16,
+	.true_color_cache_size = 1024,
+	.cursor_blink_ms = 500,
+	.virtual_elastic_tabs = false,
+	.virtual_elastic_tabs_margin = 200,
 	};
 
 
@@ -99,6 +106,20 @@ void SettingsParser::parse_setting(std::string setting_name, std::string value_t
 		settings.default_auto_wrap = parse_bool(value_token);
 	else if (setting_name == "font_size_increment")
 		settings.font_size_increment = parse_float(value_token);
+	else if (setting_name == "wheel_scroll_lines")
+		settings.wheel_scroll_lines = parse_uint32(value_token);
+	else if (setting_name == "max_frames_per_second")
+		settings.max_frames_per_second = parse_uint32(value_token);
+	else if (setting_name == "line_cache_megabytes")
+		settings.line_cache_megabytes = parse_uint32(value_token);
+	else if (setting_name == "true_color_cache_size")
+		settings.true_color_cache_size = parse_uint32(value_token);
+	else if (setting_name == "cursor_blink_ms")
+		settings.cursor_blink_ms = parse_uint32(value_token);
+	else if (setting_name == "virtual_elastic_tabs")
+		settings.virtual_elastic_tabs = parse_bool(value_token);
+	else if (setting_name == "virtual_elastic_tabs_margin")
+		settings.virtual_elastic_tabs_margin = parse_uint32(value_token);
 	else
 		fprintf(stderr, "Unknown setting: %s.\n", setting_name.c_str());
 }
@@ -26,6 +26,13 @@ struct Settings {
 	uint32_t border;
 	bool default_auto_wrap;
 	float font_size_increment;
+	uint32_t wheel_scroll_lines;
+	uint32_t max_frames_per_second;
+	uint32_t line_cache_megabytes;
+	uint32_t true_color_cache_size;
+	uint32_t cursor_blink_ms;
+	bool virtual_elastic_tabs;
+	uint32_t virtual_elastic_tabs_margin;
 
 	void	read_settings_files();
 	void	read_settings_file(std::string path);
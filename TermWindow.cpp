@@ -6,18 +6,45 @@
 #include "Colors.h"
 #include "ElasticTabs.h"
 #include "UTF8.h"
+#include "LineLayout.h"
 #include <X11/cursorfont.h>
 #include <X11/Xatom.h>
 #include <sstream>
 #include <stdexcept>
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+
+static uint64_t monotonic_ms()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+static bool x_error_caught = false;
+static int (*untrapped_x_error_handler)(Display*, XErrorEvent*) = nullptr;
+
+static int trapped_x_error_handler(Display* display, XErrorEvent* event)
+{
+	x_error_caught = true;
+	return 0;
+}
 
 
 TermWindow::TermWindow()
-	: pixmap(0), xft_draw(0)
+	: pixmap(0), xft_draw(0), drawn_top_line(0)
 {
+#ifdef SHOW_STARTUP_TIME
+	startup_ms = monotonic_ms();
+#endif
 	top_line = -1;
 	selecting_state = NotSelecting;
 	last_click_time.tv_sec = 0;
@@ -33,7 +60,29 @@ TermWindow::TermWindow()
 		throw std::runtime_error("Can't open display");
 	screen = XDefaultScreen(display);
 	Visual* visual = XDefaultVisual(display, screen);
+
+	// Everything that can wake us up: X, the terminal, the child exiting, and
+	// our own timer.
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		throw std::runtime_error("epoll_create1() failed");
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0)
+		throw std::runtime_error("timerfd_create() failed");
+	int wakeup_fds[] = {
+		XConnectionNumber(display), terminal->get_terminal_fd(),
+		terminal->get_signal_fd(), timer_fd,
+		};
+	for (int fd: wakeup_fds) {
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+			throw std::runtime_error("epoll_ctl() failed");
+		}
 	colors.init(display);
+	line_tiles = new LineTileCache(display);
 
 	// Fonts.
 	// Lots of things depend on them, so set them up early.
@@ -55,13 +104,9 @@ TermWindow::TermWindow()
 	unsigned int rows = 24;
 	int geometry_bits =
 		XParseGeometry(settings.geometry.c_str(), &x, &y, &columns, &rows);
-	XGlyphInfo glyph_info;
-	XftTextExtentsUtf8(
-		display, regular_font->plain_xft_font(),
-		(const FcChar8*) "M", 1,
-		&glyph_info);
+	int m_width = regular_font->plain_glyph_cache()->advance('M');
 	width =
-		ceil(columns * glyph_info.xOff * settings.average_character_width) +
+		ceil(columns * m_width * settings.average_character_width) +
 		2 * settings.border;
 	height = rows * regular_font->height() + 2 * settings.border;
 	if (geometry_bits & XNegative)
@@ -82,6 +127,7 @@ TermWindow::TermWindow()
 	memset(&gc_values, 0, sizeof(gc_values));
 	gc_values.graphics_exposures = False;
 	gc = XCreateGC(display, root_window, GCGraphicsExposures, &gc_values);
+	presenter = new Presenter(display, window, gc);
 
 	// Create pixmap, etc.
 	// Need to have the xft_fonts before we do this.
@@ -97,6 +143,14 @@ TermWindow::TermWindow()
 	target_atom = XInternAtom(display, "UTF8_STRING", 0);
 	if (target_atom == None)
 		target_atom = XA_STRING;
+	clipboard_atom = XInternAtom(display, "CLIPBOARD", False);
+	incr_atom = XInternAtom(display, "INCR", False);
+	targets_atom = XInternAtom(display, "TARGETS", False);
+
+	// Selection data is sent in pieces no bigger than this.
+	selection_chunk_size = XMaxRequestSize(display) * 4 - 1024;
+	if (selection_chunk_size > max_selection_chunk_size)
+		selection_chunk_size = max_selection_chunk_size;
 	XSetWMProtocols(display, window, &wm_delete_window_atom, 1);
 	set_title(settings.window_title.c_str());
 
@@ -128,42 +182,88 @@ TermWindow::~TermWindow()
 	delete terminal;
 	delete history;
 
+	delete line_tiles;
+	delete presenter;
 	cleanup_fonts();
 	XftDrawDestroy(xft_draw);
 	XFreeGC(display, gc);
 	XFreePixmap(display, pixmap);
+	close(timer_fd);
+	close(epoll_fd);
+	if (cursor_backup != None)
+		XFreePixmap(display, cursor_backup);
 	XDestroyWindow(display, window);
 }
 
 
 void TermWindow::setup_fonts()
 {
-	regular_font =
-		new FontSet(settings.font_spec, display, screen, font_size_override);
+	save_font_metrics();
+	font_generation += 1;
+	regular_font = font_set_for(settings.font_spec);
 	if (settings.line_drawing_font_spec.empty())
 		line_drawing_font = regular_font;
-	else {
-		line_drawing_font =
-			new FontSet(
-				settings.line_drawing_font_spec,
-				display, screen, font_size_override, true);
+	else
+		line_drawing_font = font_set_for(settings.line_drawing_font_spec, true);
+	// The monospace font is only opened once it's used.
+	monospace_font = nullptr;
+	if (use_monospace_font)
+		monospace_font = font_set_for(settings.monospace_font_spec);
+}
+
+
+static std::string font_set_key(const std::string& spec, double size, bool skip_italics)
+{
+	std::ostringstream key;
+	key << spec << '\n' << size << (skip_italics ? "\n-i" : "");
+	return key.str();
+}
+
+
+FontSet* TermWindow::font_set_for(const std::string& spec, bool skip_italics)
+{
+	std::string key = font_set_key(spec, font_size_override, skip_italics);
+	auto found = font_sets.find(key);
+	if (found != font_sets.end())
+		return found->second;
+
+	FontSet* font_set =
+		new FontSet(spec, display, screen, font_size_override, skip_italics);
+	font_sets[key] = font_set;
+	if (font_size_override == 0 && font_set->used_font_size > 0) {
+		// Also file it under its actual size, which is what we'll ask for when
+		// changing the size back to it.
+		font_sets.insert(
+			std::make_pair(
+				font_set_key(spec, font_set->used_font_size, skip_italics), font_set));
 		}
-	monospace_font =
-		new FontSet(
-			settings.monospace_font_spec,
-			display, screen, font_size_override);
+	return font_set;
 }
 
 
 void TermWindow::cleanup_fonts()
 {
-	delete monospace_font;
-	monospace_font = nullptr;
-	if (line_drawing_font != regular_font)
-		delete line_drawing_font;
-	line_drawing_font = nullptr;
-	delete regular_font;
-	regular_font = nullptr;
+	regular_font = line_drawing_font = monospace_font = nullptr;
+	for (auto it = font_sets.begin(); it != font_sets.end(); ++it) {
+		// A FontSet can be in there under two sizes.
+		bool is_copy = false;
+		for (auto other = font_sets.begin(); other != it; ++other) {
+			if (other->second == it->second) {
+				is_copy = true;
+				break;
+				}
+			}
+		if (!is_copy)
+			delete it->second;
+		}
+	font_sets.clear();
+}
+
+
+void TermWindow::save_font_metrics()
+{
+	for (auto& it: font_sets)
+		it.second->save_metrics();
 }
 
 
@@ -175,26 +275,79 @@ bool TermWindow::is_done()
 
 void TermWindow::tick()
 {
-	// Wait until we get something.
+	// Wait until we get something, or it's time to draw a frame.
 	if (!XPending(display)) {
-		fd_set fds;
-		FD_ZERO(&fds);
-		int xfd = XConnectionNumber(display);
-		FD_SET(xfd, &fds);
+		uint64_t now = monotonic_ms();
+		int64_t wait_ms = -1; 	// -1: forever.
+		if (needs_draw && is_visible()) {
+			uint64_t frame_time = next_frame_ms();
+			wait_ms = (frame_time > now ? frame_time - now : 0);
+			if (!presenter->ready() && (int64_t) presenter->ms_until_ready() > wait_ms)
+				wait_ms = presenter->ms_until_ready();
+			if (history->synchronized_output && synchronized_output_end_ms() > now) {
+				int64_t synchronized_wait_ms = synchronized_output_end_ms() - now;
+				if (synchronized_wait_ms > wait_ms)
+					wait_ms = synchronized_wait_ms;
+				}
+			}
+		if (cursor_blinks() && is_visible()) {
+			int64_t blink_wait_ms = (next_blink_ms > now ? next_blink_ms - now : 0);
+			if (!presenter->ready() && (int64_t) presenter->ms_until_ready() > blink_wait_ms)
+				blink_wait_ms = presenter->ms_until_ready();
+			if (wait_ms < 0 || blink_wait_ms < wait_ms)
+				wait_ms = blink_wait_ms;
+			}
+		if (resize_pending) {
+			uint64_t resize_time = last_resize_notify_ms + resize_notify_interval_ms;
+			int64_t resize_wait_ms = (resize_time > now ? resize_time - now : 0);
+			if (wait_ms < 0 || resize_wait_ms < wait_ms)
+				wait_ms = resize_wait_ms;
+			}
+		if (!selection_transfers.empty()) {
+			uint64_t expiry_time = next_selection_transfer_expiry_ms();
+			int64_t expiry_wait_ms = (expiry_time > now ? expiry_time - now : 0);
+			if (wait_ms < 0 || expiry_wait_ms < wait_ms)
+				wait_ms = expiry_wait_ms;
+			}
+		set_timer(wait_ms > 0 ? now + wait_ms : 0);
+
+		// Only wait for the terminal to be writable if we have something for it.
 		int terminal_fd = terminal->get_terminal_fd();
-		FD_SET(terminal_fd, &fds);
-		int max_fd = xfd;
-		if (terminal_fd > max_fd)
-			max_fd = terminal_fd;
-		int result = select(max_fd + 1, &fds, NULL, NULL, NULL);
-		if (result < 0 && errno != EINTR)
-			throw std::runtime_error("select() failed");
-
-		if (FD_ISSET(terminal_fd, &fds)) {
-			terminal->tick();
-			if (selecting_state == NotSelecting)
-				clear_selection();
-			draw();
+		bool wants_to_write = terminal->has_output();
+		if (wants_to_write != watching_terminal_output) {
+			struct epoll_event event;
+			memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN | (wants_to_write ? EPOLLOUT : 0);
+			event.data.fd = terminal_fd;
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, terminal_fd, &event);
+			watching_terminal_output = wants_to_write;
+			}
+
+		struct epoll_event events[max_wakeup_events];
+		int num_events =
+			epoll_wait(epoll_fd, events, max_wakeup_events, (wait_ms == 0 ? 0 : -1));
+		if (num_events < 0 && errno != EINTR)
+			throw std::runtime_error("epoll_wait() failed");
+		for (int i = 0; i < num_events; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == terminal_fd) {
+				if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0) {
+					terminal->tick();
+					if (selecting_state == NotSelecting)
+						clear_selection();
+					needs_draw = true;
+					}
+				if ((events[i].events & EPOLLOUT) != 0)
+					terminal->flush_output();
+				}
+			else if (fd == terminal->get_signal_fd())
+				terminal->signal_received();
+			else if (fd == timer_fd) {
+				uint64_t expirations;
+				if (read(timer_fd, &expirations, sizeof(expirations)) > 0)
+					timer_deadline_ms = 0;
+				}
+			// Nothing to do for X; its events are handled below.
 			}
 		}
 
@@ -203,15 +356,54 @@ void TermWindow::tick()
 		XNextEvent(display, &event);
 		if (XFilterEvent(&event, None))
 			continue;
+		if (presenter->handle_event(&event))
+			continue;
+		if (event.xany.window != window && event.type != PropertyNotify) {
+			// A window we're sending a selection to; we only care if it goes
+			// away.
+			if (event.type == DestroyNotify)
+				drop_selection_transfers(event.xdestroywindow.window, false);
+			continue;
+			}
 		switch (event.type) {
 			case ConfigureNotify:
+				// Only the latest size matters.
+				while (XCheckTypedWindowEvent(display, window, ConfigureNotify, &event))
+					;
 				resized(event.xconfigure.width, event.xconfigure.height);
 				break;
+			case MapNotify:
+			case UnmapNotify:
+			case VisibilityNotify:
+				{
+				bool was_visible = is_visible();
+				if (event.type == VisibilityNotify)
+					obscured = (event.xvisibility.state == VisibilityFullyObscured);
+				else
+					mapped = (event.type == MapNotify);
+				if (was_visible && !is_visible()) {
+					// Stop drawing.  Everything will be redrawn when we're visible
+					// again, so there's no need to keep track of scrolling either.
+					invalidate_rows();
+					pending_scrolls.clear();
+					}
+				else if (!was_visible && is_visible())
+					needs_draw = true;
+				}
+				break;
 			case Expose:
-				draw();
+				// The pixmap already has everything; just copy the exposed part.
+				XCopyArea(
+					display, pixmap, window, gc,
+					event.xexpose.x, event.xexpose.y,
+					event.xexpose.width, event.xexpose.height,
+					event.xexpose.x, event.xexpose.y);
+				if (event.xexpose.count == 0)
+					XFlush(display);
 				break;
 			case ClientMessage:
 				if ((Atom) event.xclient.data.l[0] == wm_delete_window_atom) {
+					save_font_metrics();
 					terminal->hang_up();
 					closed = true;
 					}
@@ -223,6 +415,14 @@ void TermWindow::tick()
 				mouse_button_down(&event.xbutton);
 				break;
 			case MotionNotify:
+				// Skip ahead to the last of a run of motion events.
+				while (XEventsQueued(display, QueuedAlready) > 0) {
+					XEvent next_event;
+					XPeekEvent(display, &next_event);
+					if (next_event.type != MotionNotify)
+						break;
+					XNextEvent(display, &event);
+					}
 				mouse_moved(&event.xmotion);
 				break;
 			case ButtonRelease:
@@ -232,271 +432,756 @@ void TermWindow::tick()
 				selection_requested(&event.xselectionrequest);
 				break;
 			case PropertyNotify:
-				property_changed(&event);
+				if (event.xproperty.window == window)
+					property_changed(&event);
+				else
+					continue_selection_transfer(&event.xproperty);
 				break;
 			case SelectionNotify:
 				received_selection(&event);
 				break;
+			case SelectionClear:
+				{
+				std::shared_ptr<OwnedSelection>* selection =
+					owned_selection_for(event.xselectionclear.selection);
+				if (selection)
+					selection->reset();
+				}
+				break;
 			}
 		}
+
+	// Draw if it's time.  While output is pouring in, this limits us to
+	// "max_frames_per_second"; we'll keep reading and parsing in between.  We
+	// also wait for the last frame to make it to the screen, and for the
+	// program to finish a synchronized update.  And we don't draw at all if the
+	// window can't be seen.
+	uint64_t now = monotonic_ms();
+	bool can_draw =
+		needs_draw && is_visible() &&
+		now >= next_frame_ms() && presenter->ready() &&
+		(!history->synchronized_output || now >= synchronized_output_end_ms());
+	if (can_draw)
+		draw();
+
+	// Blink the cursor.
+	bool can_blink =
+		cursor_blinks() && is_visible() && presenter->ready() &&
+		monotonic_ms() >= next_blink_ms;
+	if (can_blink)
+		blink_cursor();
+
+	// Tell the terminal about a size change, if we've been holding off.
+	if (resize_pending && monotonic_ms() >= last_resize_notify_ms + resize_notify_interval_ms)
+		notify_resize();
+
+	if (!selection_transfers.empty())
+		expire_selection_transfers();
+
+	// Ask for more of a paste, if the child has caught up.
+	resume_paste();
+}
+
+
+uint64_t TermWindow::next_frame_ms()
+{
+	if (settings.max_frames_per_second == 0)
+		return last_draw_ms;
+	return last_draw_ms + 1000 / settings.max_frames_per_second;
+}
+
+
+void TermWindow::set_timer(uint64_t deadline_ms)
+{
+	// Zero means no timer.
+	if (deadline_ms == timer_deadline_ms)
+		return;
+	timer_deadline_ms = deadline_ms;
+	struct itimerspec timer_spec;
+	memset(&timer_spec, 0, sizeof(timer_spec));
+	timer_spec.it_value.tv_sec = deadline_ms / 1000;
+	timer_spec.it_value.tv_nsec = (deadline_ms % 1000) * 1000000;
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer_spec, NULL);
+}
+
+
+void TermWindow::trim_hidden_layouts(int64_t first_line, int64_t last_line)
+{
+	// Lines that were shown but aren't anymore don't need their full layouts.
+	int64_t first_history_line = history->get_first_line();
+	int64_t last_history_line = history->get_last_line();
+	for (int64_t which_line = shown_first_line; which_line <= shown_last_line; ++which_line) {
+		if (which_line >= first_line && which_line <= last_line)
+			continue;
+		if (which_line < first_history_line || which_line > last_history_line)
+			continue;
+		history->line(which_line)->layout.trim();
+		}
+	shown_first_line = first_line;
+	shown_last_line = last_line;
 }
 
 
 void TermWindow::draw()
 {
-	// Clear the background.
-	XftDrawRect(
-		xft_draw, colors.xft_color(settings.default_background_color),
-		0, 0, width, height);
+	needs_draw = false;
+	last_draw_ms = monotonic_ms();
+
+	// Take the cursor off, so the pixmap has only the rows in it.
+	remove_cursor();
+
+	int num_rows = displayed_lines();
+	if (drawn_rows.size() != (size_t) num_rows) {
+		// Start over with a clean slate.
+		drawn_rows.assign(num_rows, DrawnRow());
+		XftDrawRect(
+			xft_draw, colors.xft_color(settings.default_background_color),
+			0, 0, width, height);
+		add_damage(0, 0, width, height);
+		pending_scrolls.clear();
+		}
 
-	// Draw the lines.
-	int64_t num_lines = displayed_lines();
+	// Move what's already in the pixmap to where it belongs now: first for
+	// lines that scrolled within the History, then for the view itself
+	// scrolling.
 	int64_t effective_top_line = calc_effective_top_line();
-	int64_t last_line = effective_top_line + num_lines - 1;
-	if (last_line > history->get_last_line())
-		last_line = history->get_last_line();
-	int y = settings.border + regular_font->ascent();
-	int64_t current_line = history->get_current_line();
-	for (int64_t which_line = effective_top_line; which_line <= last_line; ++which_line) {
-		bool line_contains_cursor =
-			which_line == current_line && history->cursor_enabled;
-		Line* line = history->line(which_line);
+	for (auto& scroll: pending_scrolls) {
+		shift_rows(
+			scroll.top_line - drawn_top_line, scroll.bottom_line - drawn_top_line,
+			scroll.num_lines);
+		}
+	pending_scrolls.clear();
+	if (effective_top_line != drawn_top_line)
+		shift_rows(0, num_rows - 1, effective_top_line - drawn_top_line);
+	drawn_top_line = effective_top_line;
+	trim_hidden_layouts(effective_top_line, effective_top_line + num_rows - 1);
+	if (settings.virtual_elastic_tabs) {
+		recalc_visible_elastic_columns(
+			effective_top_line - settings.virtual_elastic_tabs_margin,
+			effective_top_line + num_rows - 1 + settings.virtual_elastic_tabs_margin);
+		}
+
+	// Draw the lines that have changed.
+	int64_t last_line = history->get_last_line();
+	int64_t first_live_line = last_line - num_rows + 1;
+	int row_height = regular_font->height();
+	std::vector<int> rows_to_cache;
+	int y = settings.border;
+	for (int row = 0; row < num_rows; ++row, y += row_height) {
+		int64_t which_line = effective_top_line + row;
+		DrawnRow new_row;
+		new_row.line_version = 0;
+		if (which_line <= last_line) {
+			Line* line = history->line(which_line);
 
-		// Handle elastic tabs.
-		if (line->elastic_tabs) {
-			if (line->elastic_tabs->is_dirty)
-				recalc_elastic_columns(which_line);
+			// Handle elastic tabs.
+			if (line->elastic_tabs) {
+				if (line->elastic_tabs->font_generation != font_generation)
+					elastic_fonts_changed(which_line);
+				if (line->elastic_tabs->is_dirty && !settings.virtual_elastic_tabs)
+					recalc_elastic_columns(line->elastic_tabs);
+				new_row.elastic_tabs = line->elastic_tabs;
+				new_row.elastic_tabs_generation = line->elastic_tabs->generation;
+				}
+
+			new_row.line_version = line->version;
+			if (which_line >= selection_start.line && which_line <= selection_end.line) {
+				new_row.selection_start =
+					(which_line == selection_start.line ? selection_start.column : 0);
+				new_row.selection_end =
+					(which_line == selection_end.line ? selection_end.column : INT_MAX);
+				}
 			}
-		int cur_column_width = 0;
-		int which_column = 0;
-
-		// Draw the runs in the line.
-		int x = settings.border;
-		int chars_drawn = 0; 	// Only updated for the line with the cursor or a selection change on it.
-		int current_column = history->get_current_column();
-		bool in_initial_spaces = settings.synthetic_tab_spaces > 0;
-		int initial_spaces_drawn = 0;
-		for (auto run: *line) {
-			int num_bytes = strlen(run->bytes());
-			XGlyphInfo glyph_info;
-
-			uint32_t foreground_color = run->style.foreground_color;
-			uint32_t background_color = run->style.background_color;
-			if (run->style.inverse) {
-				foreground_color = run->style.background_color;
-				background_color = run->style.foreground_color;
+		if (new_row == drawn_rows[row])
+			continue;
+		drawn_rows[row] = new_row;
+		add_damage(0, y, width, row_height);
+
+		// Lines in the history (but not the live screen, which is still changing)
+		// can come from the tile cache.  Ones with the selection aren't worth
+		// caching.
+		bool cacheable =
+			line_tiles->enabled() && which_line < first_live_line &&
+			new_row.line_version != 0 && new_row.selection_start < 0;
+		if (cacheable) {
+			Pixmap tile =
+				line_tiles->get(
+					new_row.line_version, new_row.elastic_tabs_generation,
+					font_generation);
+			if (tile != None) {
+				XCopyArea(display, tile, pixmap, gc, 0, 0, width, row_height, 0, y);
+				continue;
 				}
+			rows_to_cache.push_back(row);
+			}
 
-			// Tab.
-			if (run->is_tab) {
-				int tab_width = 0;
-				if (line->elastic_tabs) {
-					ElasticTabs* elastic_tabs = line->elastic_tabs;
-					int num_columns = elastic_tabs->num_columns();
-					int column_width = 0;
-					if (which_column < num_columns)
-						column_width = elastic_tabs->column_widths[which_column];
-					else {
-						// Shouldn't happen!
-						}
-					int first_right_column =
-						num_columns - elastic_tabs->num_right_columns;
-					if (which_column + 1 == first_right_column) {
-						// Right-justify the rest of the columns.
-						// How wide are they?
-						int right_width = 0;
-						int right_column = which_column + 1;
-						for (; right_column < num_columns; ++right_column)
-							right_width += elastic_tabs->column_widths[right_column];
-						// Right-justify.
-						tab_width = (width - right_width) - x;
-						tab_width -= (elastic_tabs->num_right_columns - 1) * settings.column_separation;
-						}
-					else {
-						tab_width =
-							column_width - cur_column_width + settings.column_separation;
-						}
-					}
-				else {
-					tab_width = settings.tab_width - (x % settings.tab_width);
-					// Make sure we always have at least the width of a space.
-					XftTextExtentsUtf8(
-						display, xft_font_for(run->style),
-						(const FcChar8*) " ", 1, &glyph_info);
-					if (tab_width < glyph_info.xOff)
-						tab_width += settings.tab_width;
-					}
+		// Clear the row, and draw the line.
+		draw_batch.add_clear(0, y, width, row_height);
+		if (new_row.line_version != 0)
+			draw_line(which_line, y + regular_font->ascent());
+		}
 
-				// Draw the tab.
-				SelectionPoint draw_point(which_line, chars_drawn);
-				bool inversity =
-					(line_contains_cursor && current_column == chars_drawn) ^
-					(draw_point >= selection_start && draw_point < selection_end);
-				uint32_t cur_background = (inversity ? foreground_color : background_color);
-				if (cur_background != settings.default_background_color) {
-					XftDrawRect(
-						xft_draw, colors.xft_color(cur_background),
-						x, y - regular_font->ascent(),
-						tab_width, regular_font->height());
-					}
-				x += tab_width;
-				chars_drawn += 1;
+	if (!draw_batch.empty())
+		draw_batch.draw(display, pixmap, gc, xft_draw);
+	for (int row: rows_to_cache) {
+		line_tiles->add(
+			drawn_rows[row].line_version, drawn_rows[row].elastic_tabs_generation,
+			font_generation, pixmap, settings.border + row * row_height);
+		}
+	draw_cursor();
+	present();
+
+#ifdef SHOW_STARTUP_TIME
+	if (startup_ms != 0) {
+		XSync(display, False);
+		printf("First frame: %llu ms.\n", (unsigned long long) (monotonic_ms() - startup_ms));
+		startup_ms = 0;
+		}
+#endif
+}
 
-				// Start the next column.
-				which_column += 1;
-				cur_column_width = 0;
-				in_initial_spaces = false;
 
-				continue;
-				}
+void TermWindow::draw_line(int64_t which_line, int y)
+{
+	// "y" is the baseline.
+	Line* line = history->line(which_line);
+	LineLayout* layout = layout_for(line);
+	int left = settings.border;
 
-			// We'll break the run up into "subruns", because there may be inversity
-			// changes within the run (if it contains the cursor or the start of end
-			// of the selection), and also to handle synthetic tabs.
-			XftFont* xft_font = xft_font_for(run->style);
-			int run_chars = run->num_characters();
-			int run_end_char = chars_drawn + run_chars;
-			const char* subrun_start_byte = run->bytes();
-			while (chars_drawn < run_end_char) {
-				// Where does the subrun end?
-				int subrun_end_char = run_end_char;
-				// It might end at the cursor.
-				if (line_contains_cursor) {
-					if (current_column == chars_drawn)
-						subrun_end_char = current_column + 1;
-					else if (current_column > chars_drawn && current_column < run_end_char)
-						subrun_end_char = current_column;
-					}
-				// It might end at the selection start or end.
-				if (which_line == selection_start.line) {
-					if (selection_start.column > chars_drawn && selection_start.column < subrun_end_char)
-						subrun_end_char = selection_start.column;
-					}
-				if (which_line == selection_end.line) {
-					if (selection_end.column > chars_drawn && selection_end.column < subrun_end_char)
-						subrun_end_char = selection_end.column;
-					}
-				// It might be part of the initial spaces, and be treated as part of
-				// synthetic tabs.
-				int subrun_initial_spaces = 0;
-				if (in_initial_spaces) {
-					const char* subrun_end = subrun_start_byte + (subrun_end_char - chars_drawn);
-					for (const char* p = subrun_start_byte; p < subrun_end; ++p) {
-						if (*p != ' ')
-							break;
-						subrun_initial_spaces += 1;
-						}
-					if (subrun_initial_spaces > 0)
-						subrun_end_char = chars_drawn + subrun_initial_spaces;
-					else
-						in_initial_spaces = false;
-					}
+	// Draw the runs in the line.
+	int chars_drawn = 0;
+	int synthetic_tab_end =
+		settings.synthetic_tab_spaces > 0 ? layout->initial_spaces : 0;
+	for (auto run: *line) {
+		int num_bytes = strlen(run->bytes());
 
-				// Figure out the subrun.
-				int subrun_num_chars = subrun_end_char - chars_drawn;
-				int subrun_num_bytes =
-					UTF8::bytes_for_n_characters(
-						subrun_start_byte,
-						num_bytes - (subrun_start_byte - run->bytes()),
-						subrun_num_chars);
-				XftTextExtentsUtf8(
-					display, xft_font,
-					(const FcChar8*) subrun_start_byte, subrun_num_bytes,
-					&glyph_info);
-				int subrun_width = glyph_info.xOff;
-
-				// Handle synthetic tabs.
-				if (in_initial_spaces) {
-					int width_drawn = x - settings.border;
-					int num_spaces = initial_spaces_drawn + subrun_initial_spaces;
-					int width_needed =
-						(num_spaces / settings.synthetic_tab_spaces) *
-						settings.tab_width;
-					if (num_spaces % settings.synthetic_tab_spaces != 0) {
-						XftTextExtentsUtf8(
-							display, xft_font,
-							(const FcChar8*) " ", 1,
-							&glyph_info);
-						width_needed +=
-							(num_spaces % settings.synthetic_tab_spaces) * glyph_info.xOff;
-						}
-					if (width_needed > width_drawn + subrun_width)
-						subrun_width = width_needed - width_drawn;
-					initial_spaces_drawn += subrun_initial_spaces;
-					}
+		uint32_t foreground_color = run->style.foreground_color;
+		uint32_t background_color = run->style.background_color;
+		if (run->style.inverse) {
+			foreground_color = run->style.background_color;
+			background_color = run->style.foreground_color;
+			}
 
-				SelectionPoint draw_point(which_line, chars_drawn);
-				bool inversity =
-					(line_contains_cursor && current_column == chars_drawn) ^
-					(draw_point >= selection_start && draw_point < selection_end);
+		// Tab.
+		if (run->is_tab) {
+			int x = left + layout->x[chars_drawn];
+			int tab_width = layout->x[chars_drawn + 1] - layout->x[chars_drawn];
+
+			// Draw the tab.
+			SelectionPoint draw_point(which_line, chars_drawn);
+			bool inversity = (draw_point >= selection_start && draw_point < selection_end);
+			uint32_t cur_background = (inversity ? foreground_color : background_color);
+			if (cur_background != settings.default_background_color) {
+				draw_batch.add_background(
+					cur_background,
+					x, y - regular_font->ascent(),
+					tab_width, regular_font->height());
+				}
+			chars_drawn += 1;
+			continue;
+			}
 
-				// Draw the background.
-				uint32_t cur_background = (inversity ? foreground_color : background_color);
-				XftDrawRect(
-					xft_draw, colors.xft_color(cur_background), 
+		// We'll break the run up into "subruns", because there may be inversity
+		// changes within the run (if it contains the start or end of the
+		// selection), and also to handle synthetic tabs.
+		GlyphCache* glyph_cache = glyph_cache_for(run->style);
+		int run_chars = run->num_characters();
+		int run_end_char = chars_drawn + run_chars;
+		const char* subrun_start_byte = run->bytes();
+		while (chars_drawn < run_end_char) {
+			// Where does the subrun end?
+			int subrun_end_char = run_end_char;
+			// It might end at the selection start or end.
+			if (which_line == selection_start.line) {
+				if (selection_start.column > chars_drawn && selection_start.column < subrun_end_char)
+					subrun_end_char = selection_start.column;
+				}
+			if (which_line == selection_end.line) {
+				if (selection_end.column > chars_drawn && selection_end.column < subrun_end_char)
+					subrun_end_char = selection_end.column;
+				}
+			// It might end at the end of the synthetic tabs, which are wider than
+			// the spaces they're made of.
+			if (synthetic_tab_end > chars_drawn && synthetic_tab_end < subrun_end_char)
+				subrun_end_char = synthetic_tab_end;
+
+			// Figure out the subrun.
+			int subrun_num_chars = subrun_end_char - chars_drawn;
+			int subrun_num_bytes =
+				UTF8::bytes_for_n_characters(
+					subrun_start_byte,
+					num_bytes - (subrun_start_byte - run->bytes()),
+					subrun_num_chars);
+			int x = left + layout->x[chars_drawn];
+			int subrun_width = layout->x[subrun_end_char] - layout->x[chars_drawn];
+
+			SelectionPoint draw_point(which_line, chars_drawn);
+			bool inversity = (draw_point >= selection_start && draw_point < selection_end);
+
+			// Draw the background.  The row has already been cleared to the
+			// default background.
+			uint32_t cur_background = (inversity ? foreground_color : background_color);
+			if (cur_background != settings.default_background_color) {
+				draw_batch.add_background(
+					cur_background,
 					x, y - regular_font->ascent(),
 					subrun_width, regular_font->height());
+				}
 
-				// Characters.
-				if (!run->style.invisible) {
-					uint32_t cur_foreground = (inversity ? background_color : foreground_color);
-					XftDrawStringUtf8(
-						xft_draw, colors.xft_color(cur_foreground), xft_font,
-						x, y,
-						(const FcChar8*) subrun_start_byte, subrun_num_bytes);
+			// Characters.  Each glyph goes where the layout says its column is.
+			if (!run->style.invisible) {
+				uint32_t cur_foreground = (inversity ? background_color : foreground_color);
+				const char* p = subrun_start_byte;
+				const char* end = subrun_start_byte + subrun_num_bytes;
+				for (int column = chars_drawn; p < end && column < subrun_end_char; ++column) {
+					uint32_t c = UTF8::decode(p, end);
+					if (c == ' ')
+						continue;
+					const GlyphCache::Glyph& glyph = glyph_cache->glyph(c);
+					draw_batch.add_glyph(
+						cur_foreground, glyph.font, glyph.index,
+						left + layout->x[column], y);
 					}
+				}
 
-				// Decorations.
-				if (run->style.has_decorations())
-					decorate_run(run->style, x, subrun_width, y);
+			// Decorations.
+			if (run->style.has_decorations())
+				decorate_run(run->style, x, subrun_width, y);
 
-				chars_drawn += subrun_num_chars;
-				subrun_start_byte += subrun_num_bytes;
-				x += subrun_width;
-				cur_column_width += subrun_width;
-				}
+			chars_drawn += subrun_num_chars;
+			subrun_start_byte += subrun_num_bytes;
 			}
+		}
+}
+
+
+void TermWindow::draw_cursor()
+{
+	if (!history->cursor_enabled)
+		return;
+	int64_t current_line = history->get_current_line();
+	int64_t row = current_line - drawn_top_line;
+	if (row < 0 || row >= (int64_t) drawn_rows.size() || current_line > history->get_last_line())
+		return;
 
-		// Draw the cursor if it's at the end of the line.
-		bool draw_eol_cursor =
-			which_line == current_line && current_column >= chars_drawn &&
-			history->cursor_enabled;
-		if (draw_eol_cursor) {
-			// "x" is already at the end of the line.
-			XGlyphInfo glyph_info;
-			XftTextExtentsUtf8(
-				display, regular_font->plain_xft_font(),
-				(const FcChar8*) " ", 1,
-				&glyph_info);
-			XftDrawRect(
-				xft_draw, colors.xft_color(settings.default_foreground_color), 
-				x, y - regular_font->ascent(),
-				glyph_info.xOff, regular_font->height());
+	// Blinking starts over whenever the cursor moves.
+	int current_column = history->get_current_column();
+	if (current_line != blink_cursor_line || current_column != blink_cursor_column) {
+		blink_cursor_line = current_line;
+		blink_cursor_column = current_column;
+		cursor_blink_on = true;
+		next_blink_ms = monotonic_ms() + settings.cursor_blink_ms;
+		}
+	if (cursor_blinks() && !cursor_blink_on)
+		return;
+
+	// Where is it, and what's under it?
+	Line* line = history->line(current_line);
+	LineLayout* layout = layout_for(line);
+	int num_columns = layout->num_columns();
+	int x = settings.border;
+	int cell_width = regular_font->plain_glyph_cache()->advance(' ');
+	Style style;
+	uint32_t c = ' ';
+	if (current_column < num_columns) {
+		x += layout->x[current_column];
+		cell_width = layout->x[current_column + 1] - layout->x[current_column];
+		int run_start_column = 0;
+		for (auto run: *line) {
+			int run_chars = (run->is_tab ? 1 : run->num_characters());
+			if (current_column < run_start_column + run_chars) {
+				style = run->style;
+				if (!run->is_tab) {
+					const char* run_end = run->bytes() + strlen(run->bytes());
+					const char* p =
+						run->bytes() +
+						UTF8::bytes_for_n_characters(
+							run->bytes(), run_end - run->bytes(),
+							current_column - run_start_column);
+					c = UTF8::decode(p, run_end);
+					}
+				break;
+				}
+			run_start_column += run_chars;
 			}
+		}
+	else
+		x += layout->x[num_columns];
+	// The colors are what draw_line() used for the cell: inverted by the style,
+	// and inverted (again) if it's selected.
+	SelectionPoint cursor_point(current_line, current_column);
+	bool inversity = (cursor_point >= selection_start && cursor_point < selection_end);
+	uint32_t foreground_color = style.foreground_color;
+	uint32_t background_color = style.background_color;
+	if (style.inverse != inversity) {
+		foreground_color = style.background_color;
+		background_color = style.foreground_color;
+		}
 
-		y += regular_font->height();
+	// Figure out its shape.
+	int row_height = regular_font->height();
+	XRectangle& rect = drawn_cursor.rect;
+	rect.x = x;
+	rect.y = settings.border + row * row_height;
+	rect.width = cell_width;
+	rect.height = row_height;
+	if (history->cursor_shape == History::UnderlineCursor) {
+		rect.height = 2;
+		rect.y += row_height - rect.height;
+		}
+	else if (history->cursor_shape == History::BarCursor)
+		rect.width = 2;
+
+	// Save what's under it.
+	if (rect.width > cursor_backup_width || rect.height > cursor_backup_height) {
+		if (cursor_backup != None)
+			XFreePixmap(display, cursor_backup);
+		if (rect.width > cursor_backup_width)
+			cursor_backup_width = rect.width;
+		if (rect.height > cursor_backup_height)
+			cursor_backup_height = rect.height;
+		cursor_backup =
+			XCreatePixmap(
+				display, window, cursor_backup_width, cursor_backup_height,
+				DefaultDepth(display, screen));
 		}
+	XCopyArea(
+		display, pixmap, cursor_backup, gc,
+		rect.x, rect.y, rect.width, rect.height, 0, 0);
+
+	// Draw it.  A block cursor shows the character under it, inverted.
+	draw_batch.add_background(
+		foreground_color, rect.x, rect.y, rect.width, rect.height);
+	if (history->cursor_shape == History::BlockCursor && c != ' ' && !style.invisible) {
+		const GlyphCache::Glyph& glyph = glyph_cache_for(style)->glyph(c);
+		draw_batch.add_glyph(
+			background_color, glyph.font, glyph.index,
+			x, rect.y + regular_font->ascent());
+		}
+	XftDrawSetClipRectangles(xft_draw, 0, 0, &rect, 1);
+	draw_batch.draw(display, pixmap, gc, xft_draw);
+	XftDrawSetClip(xft_draw, nullptr);
+	drawn_cursor.shown = true;
+	add_damage(rect.x, rect.y, rect.width, rect.height);
+}
 
-	// Copy to the screen.
+
+void TermWindow::remove_cursor()
+{
+	if (!drawn_cursor.shown)
+		return;
+	XRectangle& rect = drawn_cursor.rect;
 	XCopyArea(
-		display, pixmap, window, gc, 0, 0, width, height, 0, 0);
-	XFlush(display);
+		display, cursor_backup, pixmap, gc,
+		0, 0, rect.width, rect.height, rect.x, rect.y);
+	add_damage(rect.x, rect.y, rect.width, rect.height);
+	drawn_cursor.shown = false;
+}
+
+
+bool TermWindow::cursor_blinks()
+{
+	return
+		history->cursor_enabled && history->cursor_blinks &&
+		settings.cursor_blink_ms > 0;
+}
+
+
+void TermWindow::blink_cursor()
+{
+	cursor_blink_on = !cursor_blink_on;
+	next_blink_ms = monotonic_ms() + settings.cursor_blink_ms;
+
+	// If there's a draw coming, it'll take care of it.  Otherwise, just redraw
+	// the cursor.
+	if (needs_draw)
+		return;
+	remove_cursor();
+	draw_cursor();
+	present();
+}
+
+
+LineLayout* TermWindow::layout_for(Line* line)
+{
+	LineLayout* layout = measured_layout_for(line);
+	uint64_t elastic_tabs_generation =
+		line->elastic_tabs ? line->elastic_tabs->generation : 0;
+	bool up_to_date =
+		layout->elastic_tabs == line->elastic_tabs &&
+		layout->elastic_tabs_generation == elastic_tabs_generation &&
+		layout->window_width == (int) width;
+	if (!up_to_date) {
+		position_line(line, layout);
+		layout->elastic_tabs = line->elastic_tabs;
+		layout->elastic_tabs_generation = elastic_tabs_generation;
+		layout->window_width = width;
+		}
+	return layout;
+}
+
+
+LineLayout* TermWindow::measured_layout_for(Line* line, bool need_cells)
+{
+	// If "need_cells" is false, only the segment widths are needed, so the
+	// layout is left trimmed.
+	LineLayout* layout = &line->layout;
+	bool up_to_date =
+		layout->line_version == line->version &&
+		layout->font_generation == font_generation &&
+		(!layout->trimmed || !need_cells);
+	if (up_to_date)
+		return layout;
+
+	layout->cells.clear();
+	layout->segment_widths.clear();
+	layout->initial_spaces = 0;
+	layout->monospace_width =
+		use_monospace_font ? monospace_font->plain_glyph_cache()->advance('M') : 0;
+	bool in_initial_spaces = true;
+	int segment_width = 0;
+	for (auto run: *line) {
+		GlyphCache* glyph_cache = glyph_cache_for(run->style);
+		LineLayout::Cell cell;
+
+		// Tab.
+		if (run->is_tab) {
+			cell.advance = glyph_cache->advance(' ');
+			cell.is_tab = true;
+			layout->cells.push_back(cell);
+			layout->segment_widths.push_back(segment_width);
+			segment_width = 0;
+			in_initial_spaces = false;
+			continue;
+			}
+
+		// Characters.
+		cell.is_tab = false;
+		int run_start_column = layout->cells.size();
+		if (layout->monospace_width > 0) {
+			// Monospace: there's nothing to measure, every character is the same
+			// width.
+			const char* p = run->bytes();
+			if (in_initial_spaces) {
+				for (; *p == ' '; ++p)
+					layout->initial_spaces += 1;
+				if (*p)
+					in_initial_spaces = false;
+				}
+			int run_chars = run->num_characters();
+			cell.advance = layout->monospace_width;
+			layout->cells.resize(run_start_column + run_chars, cell);
+			segment_width += run_chars * cell.advance;
+			continue;
+			}
+		const char* p = run->bytes();
+		const char* end = p + strlen(p);
+		while (p < end) {
+			if (in_initial_spaces) {
+				if (*p == ' ')
+					layout->initial_spaces += 1;
+				else
+					in_initial_spaces = false;
+				}
+			cell.advance = glyph_cache->advance(UTF8::decode(p, end));
+			layout->cells.push_back(cell);
+			segment_width += cell.advance;
+			}
+		// Make sure the columns match up with the characters, even if the run has
+		// invalid UTF8 in it.
+		cell.advance = 0;
+		layout->cells.resize(run_start_column + run->num_characters(), cell);
+		}
+	layout->segment_widths.push_back(segment_width);
+
+	layout->line_version = line->version;
+	layout->font_generation = font_generation;
+	layout->trimmed = false;
+	layout->invalidate_positions();
+	if (!need_cells)
+		layout->trim();
+	return layout;
+}
+
+
+void TermWindow::position_line(Line* line, LineLayout* layout)
+{
+	ElasticTabs* elastic_tabs = line->elastic_tabs;
+	int num_columns = layout->num_columns();
+	layout->x.resize(num_columns + 1);
+
+	// Monospace with no tabs (real or synthetic) is the easy case.
+	layout->uniform =
+		layout->monospace_width > 0 && layout->segment_widths.size() == 1 &&
+		(layout->initial_spaces == 0 || settings.synthetic_tab_spaces <= 0);
+	if (layout->uniform) {
+		for (int column = 0; column <= num_columns; ++column)
+			layout->x[column] = column * layout->monospace_width;
+		return;
+		}
+	int x = 0;
+	int which_elastic_column = 0;
+	int cur_column_width = 0;
+	for (int column = 0; column < num_columns; ++column) {
+		layout->x[column] = x;
+		const LineLayout::Cell& cell = layout->cells[column];
+
+		// Tab.
+		if (cell.is_tab) {
+			int tab_width = 0;
+			if (elastic_tabs) {
+				int num_elastic_columns = elastic_tabs->num_columns();
+				int column_width = 0;
+				if (which_elastic_column < num_elastic_columns)
+					column_width = elastic_tabs->column_widths[which_elastic_column];
+				else {
+					// Shouldn't happen!
+					}
+				int first_right_column =
+					num_elastic_columns - elastic_tabs->num_right_columns;
+				if (which_elastic_column + 1 == first_right_column) {
+					// Right-justify the rest of the columns.
+					// How wide are they?
+					int right_width = 0;
+					int right_column = which_elastic_column + 1;
+					for (; right_column < num_elastic_columns; ++right_column)
+						right_width += elastic_tabs->column_widths[right_column];
+					// Right-justify.
+					tab_width = (width - right_width) - (settings.border + x);
+					tab_width -= (elastic_tabs->num_right_columns - 1) * settings.column_separation;
+					}
+				else {
+					tab_width =
+						column_width - cur_column_width + settings.column_separation;
+					}
+				}
+			else {
+				tab_width = settings.tab_width - ((settings.border + x) % settings.tab_width);
+				// Make sure we always have at least the width of a space.
+				if (tab_width < cell.advance)
+					tab_width += settings.tab_width;
+				}
+			x += tab_width;
+
+			// Start the next column.
+			which_elastic_column += 1;
+			cur_column_width = 0;
+			continue;
+			}
+
+		// Character.
+		int advance = cell.advance;
+		if (column < layout->initial_spaces && settings.synthetic_tab_spaces > 0) {
+			// Synthetic tabs: widen the last space of each group of
+			// "synthetic_tab_spaces" to make it "tab_width" wide.
+			int num_spaces = column + 1;
+			int width_needed =
+				(num_spaces / settings.synthetic_tab_spaces) * settings.tab_width +
+				(num_spaces % settings.synthetic_tab_spaces) * cell.advance;
+			if (width_needed > x + advance)
+				advance = width_needed - x;
+			}
+		x += advance;
+		cur_column_width += advance;
+		}
+	layout->x[num_columns] = x;
+}
+
+
+void TermWindow::shift_rows(int64_t first_row, int64_t last_row, int64_t num_rows)
+{
+	// Moves the contents of the rows up by "num_rows" (down, if negative).
+	// Rows that have nothing to move into them are left to be redrawn.
+
+	if (first_row < 0)
+		first_row = 0;
+	if (last_row >= (int64_t) drawn_rows.size())
+		last_row = (int64_t) drawn_rows.size() - 1;
+	if (first_row > last_row || num_rows == 0)
+		return;
+	int64_t region_rows = last_row - first_row + 1;
+	if (num_rows >= region_rows || -num_rows >= region_rows) {
+		// Nothing left to move.
+		for (int64_t row = first_row; row <= last_row; ++row)
+			drawn_rows[row] = DrawnRow();
+		return;
+		}
+
+	int row_height = regular_font->height();
+	int first_y = settings.border + first_row * row_height;
+	int moved_height = (region_rows - llabs(num_rows)) * row_height;
+	if (num_rows > 0) {
+		XCopyArea(
+			display, pixmap, pixmap, gc,
+			0, first_y + num_rows * row_height, width, moved_height,
+			0, first_y);
+		for (int64_t row = first_row; row <= last_row; ++row) {
+			if (row + num_rows <= last_row)
+				drawn_rows[row] = drawn_rows[row + num_rows];
+			else
+				drawn_rows[row] = DrawnRow();
+			}
+		}
+	else {
+		XCopyArea(
+			display, pixmap, pixmap, gc,
+			0, first_y, width, moved_height,
+			0, first_y - num_rows * row_height);
+		for (int64_t row = last_row; row >= first_row; --row) {
+			if (row + num_rows >= first_row)
+				drawn_rows[row] = drawn_rows[row + num_rows];
+			else
+				drawn_rows[row] = DrawnRow();
+			}
+		}
+	add_damage(0, first_y, width, region_rows * row_height);
+}
+
+
+void TermWindow::add_damage(int x, int y, int width, int height)
+{
+	// Rows are damaged from top to bottom, so we can usually just extend the
+	// last rectangle.
+	if (!damage.empty()) {
+		XRectangle& last = damage.back();
+		bool already_damaged =
+			x >= last.x && y >= last.y &&
+			x + width <= last.x + last.width && y + height <= last.y + last.height;
+		if (already_damaged)
+			return;
+		if (last.x == x && last.width == width && last.y + last.height == y) {
+			last.height += height;
+			return;
+			}
+		}
+	XRectangle rect;
+	rect.x = x;
+	rect.y = y;
+	rect.width = width;
+	rect.height = height;
+	damage.push_back(rect);
+}
+
+
+void TermWindow::present()
+{
+	presenter->present(pixmap, damage);
+	damage.clear();
 }
 
 
 void TermWindow::decorate_run(Style style, int x, int width, int y)
 {
-	XSetForeground(
-		display, gc, colors.xft_color(settings.default_foreground_color)->pixel);
+	uint32_t color = settings.default_foreground_color;
 	int x2 = x + width - 1;
 	if (style.underlined || style.doubly_underlined) {
-		XDrawLine(display, pixmap, gc, x, y + 1, x2, y + 1);
+		draw_batch.add_line(color, x, x2, y + 1);
 		if (style.doubly_underlined)
-			XDrawLine(display, pixmap, gc, x, y + 3, x2, y + 3);
+			draw_batch.add_line(color, x, x2, y + 3);
 		}
 	if (style.crossed_out) {
 		int cross_y = y - regular_font->ascent() / 3;
-		XDrawLine(display, pixmap, gc, x, cross_y, x2, cross_y);
+		draw_batch.add_line(color, x, x2, cross_y);
 		}
 }
 
@@ -506,25 +1191,37 @@ void TermWindow::resized(unsigned int new_width, unsigned int new_height)
 	if (pixmap && new_width == width && new_height == height)
 		return;
 
-	// Set up drawing (new pixmap etc.).
+	// Set up drawing (new pixmap etc.).  The pixmap's size is rounded up, so
+	// resizing the window a little at a time doesn't need a new one every time.
 	width = new_width;
 	height = new_height;
-	if (pixmap)
-		XFreePixmap(display, pixmap);
-	pixmap = XCreatePixmap(display, window, width, height, DefaultDepth(display, screen));
-	if (xft_draw)
-		XftDrawChange(xft_draw, pixmap);
-	else {
-		xft_draw =
-			XftDrawCreate(
-				display, pixmap,
-				XDefaultVisual(display, screen),
-				XDefaultColormap(display, screen));
+	unsigned int new_pixmap_width = (width + pixmap_size_bucket - 1) / pixmap_size_bucket * pixmap_size_bucket;
+	unsigned int new_pixmap_height = (height + pixmap_size_bucket - 1) / pixmap_size_bucket * pixmap_size_bucket;
+	if (!pixmap || new_pixmap_width != pixmap_width || new_pixmap_height != pixmap_height) {
+		if (pixmap)
+			XFreePixmap(display, pixmap);
+		pixmap_width = new_pixmap_width;
+		pixmap_height = new_pixmap_height;
+		pixmap =
+			XCreatePixmap(
+				display, window, pixmap_width, pixmap_height,
+				DefaultDepth(display, screen));
+		if (xft_draw)
+			XftDrawChange(xft_draw, pixmap);
+		else {
+			xft_draw =
+				XftDrawCreate(
+					display, pixmap,
+					XDefaultVisual(display, screen),
+					XDefaultColormap(display, screen));
+			}
 		}
 	XSetForeground(display, gc, attributes.background_pixel);
 	XFillRectangle(display, pixmap, gc, 0, 0, width, height);
+	drawn_cursor.shown = false;
 
 	screen_size_changed();
+	needs_draw = true;
 }
 
 
@@ -538,27 +1235,85 @@ void TermWindow::set_title(const char* title)
 }
 
 
+void TermWindow::lines_scrolled(int64_t top_line, int64_t bottom_line, int num_lines)
+{
+	// Nothing is being drawn while we're not visible.
+	if (!is_visible())
+		return;
+
+	// Successive scrolls of the same region (the usual case) are combined.
+	if (!pending_scrolls.empty()) {
+		PendingScroll& last = pending_scrolls.back();
+		bool combinable =
+			last.top_line == top_line && last.bottom_line == bottom_line &&
+			(last.num_lines > 0) == (num_lines > 0);
+		if (combinable) {
+			last.num_lines += num_lines;
+			return;
+			}
+		}
+	if (pending_scrolls.size() >= (size_t) max_pending_scrolls) {
+		// Not worth keeping track of; just redraw everything.
+		pending_scrolls.clear();
+		invalidate_rows();
+		return;
+		}
+	PendingScroll scroll = { top_line, bottom_line, num_lines };
+	pending_scrolls.push_back(scroll);
+}
+
+
+void TermWindow::synchronized_output_changed()
+{
+	if (history->synchronized_output) {
+		// The program is starting to update the screen.  If what it did before
+		// hasn't been drawn yet, now's the time, while it's complete.
+		uint64_t now = monotonic_ms();
+		bool can_draw =
+			needs_draw && is_visible() &&
+			now >= next_frame_ms() && presenter->ready();
+		if (can_draw)
+			draw();
+		synchronized_output_start_ms = now;
+		}
+	else
+		needs_draw = true;
+}
+
+
 void TermWindow::screen_size_changed()
 {
-	XGlyphInfo glyph_info;
-	XftTextExtentsUtf8(
-		display, (use_monospace_font ? monospace_font : regular_font)->plain_xft_font(),
-		(const FcChar8*) "M", 1,
-		&glyph_info);
+	// Everything will need to be redrawn.
+	invalidate_rows();
+	line_tiles->set_tile_size(
+		pixmap, width, regular_font->height(), DefaultDepth(display, screen));
+
+	int m_width =
+		(use_monospace_font ? monospace_font : regular_font)->plain_glyph_cache()->advance('M');
 	int lines_on_screen = displayed_lines();
 	double average_character_width =
 		use_monospace_font ? 1.0 : settings.average_character_width;
 	int characters_per_line =
 		(width - 2 * settings.border) /
-		(glyph_info.xOff * average_character_width);
+		(m_width * average_character_width);
 
 	history->set_lines_on_screen(lines_on_screen);
 	history->set_characters_per_line(characters_per_line);
 
-	// Notify the terminal.
-	terminal->notify_resize(
-		characters_per_line, lines_on_screen,
-		width, height);
+	// Notify the terminal, unless we just did; then it'll have to wait.
+	resize_columns = characters_per_line;
+	resize_rows = lines_on_screen;
+	resize_pending = true;
+	if (monotonic_ms() >= last_resize_notify_ms + resize_notify_interval_ms)
+		notify_resize();
+}
+
+
+void TermWindow::notify_resize()
+{
+	terminal->notify_resize(resize_columns, resize_rows, width, height);
+	resize_pending = false;
+	last_resize_notify_ms = monotonic_ms();
 }
 
 
@@ -568,39 +1323,27 @@ void TermWindow::key_down(XKeyEvent* event)
 	KeySym keySym = 0;
 	int length = XLookupString(event, buffer, sizeof(buffer), &keySym, NULL);
 
+	// Ctrl-Shift-C/V: copy and paste with the clipboard.
+	if ((event->state & (ControlMask | ShiftMask)) == (ControlMask | ShiftMask)) {
+		if (keySym == XK_C || keySym == XK_c) {
+			copy_to_clipboard(event->time);
+			return;
+			}
+		else if (keySym == XK_V || keySym == XK_v) {
+			paste(clipboard_atom);
+			return;
+			}
+		}
+
 	// Shift-PgUp/PgDown/Insert.
 	if ((event->state & ShiftMask) != 0) {
-		int64_t num_lines = displayed_lines();
-		int64_t half_page = num_lines / 2 + 1;
+		int64_t half_page = displayed_lines() / 2 + 1;
 		if (keySym == XK_Page_Up) {
-			if (top_line < 0) {
-				// Scroll up from the bottom.
-				if (history->get_last_line() < num_lines) {
-					// All the lines still fit on the screen; don't change anything.
-					return;
-					}
-				top_line = history->get_last_line() - num_lines + 1 - half_page;
-				if (top_line < history->get_first_line())
-					top_line = history->get_first_line();
-				}
-			else {
-				// Scroll up from where we are.
-				top_line -= half_page;
-				if (top_line < history->get_first_line())
-					top_line = history->get_first_line();
-				}
-			draw();
+			scroll_view(-half_page);
 			return;
 			}
 		else if (keySym == XK_Page_Down) {
-			if (top_line >= 0) {
-				top_line += half_page;
-				if (top_line > history->get_last_line() - num_lines) {
-					// We've reached the end.
-					top_line = -1;
-					}
-				draw();
-				}
+			scroll_view(half_page);
 			return;
 			}
 		else if (keySym == XK_Insert) {
@@ -609,7 +1352,7 @@ void TermWindow::key_down(XKeyEvent* event)
 			cleanup_fonts();
 			setup_fonts();
 			screen_size_changed();
-			draw();
+			needs_draw = true;
 			return;
 			}
 		}
@@ -619,27 +1362,29 @@ void TermWindow::key_down(XKeyEvent* event)
 		if (keySym == XK_minus) {
 			if (regular_font->used_font_size > 2 * settings.font_size_increment) {
 				font_size_override = regular_font->used_font_size - settings.font_size_increment;
-				cleanup_fonts();
 				setup_fonts();
 				screen_size_changed();
-				draw();
+				needs_draw = true;
 				}
 			return;
 			}
 		else if (keySym == XK_plus || keySym == XK_equal) {
 			if (regular_font->used_font_size > 0) {
 				font_size_override = regular_font->used_font_size + settings.font_size_increment;
-				cleanup_fonts();
 				setup_fonts();
 				screen_size_changed();
-				draw();
+				needs_draw = true;
 				}
 			return;
 			}
 		else if (keySym == XK_Escape) {
+			save_font_metrics();
 			use_monospace_font = !use_monospace_font;
+			if (use_monospace_font && monospace_font == nullptr)
+				monospace_font = font_set_for(settings.monospace_font_spec);
+			font_generation += 1;
 			screen_size_changed();
-			draw();
+			needs_draw = true;
 			return;
 			}
 		}
@@ -774,12 +1519,18 @@ void TermWindow::mouse_button_down(XButtonEvent* event)
 			selecting_by = SelectingByChar;
 		last_click_time = now;
 
-		draw();
+		needs_draw = true;
 		}
 
 	else if (event->button == Button2) {
-		paste();
+		paste(XA_PRIMARY);
 		}
+
+	// Mouse wheel.
+	else if (event->button == Button4)
+		scroll_view(-(int64_t) settings.wheel_scroll_lines);
+	else if (event->button == Button5)
+		scroll_view(settings.wheel_scroll_lines);
 }
 
 
@@ -853,7 +1604,7 @@ void TermWindow::mouse_moved(XMotionEvent* event)
 		selection_end.column = INT_MAX;
 		}
 
-	draw();
+	needs_draw = true;
 }
 
 
@@ -865,35 +1616,161 @@ void TermWindow::mouse_button_up(XButtonEvent* event)
 	if (event->button == Button1) {
 		selecting_state = NotSelecting;
 
-		// Build the selected text.
-		std::stringstream text;
-		for (int which_line = selection_start.line; which_line <= selection_end.line; ++which_line) {
-			Line* line = history->line(which_line);
-			if (line == nullptr)
-				continue;
-			text <<
-				line->characters_from_to(
-					which_line == selection_start.line ? selection_start.column : 0,
-					which_line == selection_end.line ? selection_end.column : INT_MAX);
-			if (which_line != selection_end.line || selecting_by == SelectingByLine)
-				text << '\n';
-			}
-		selected_text = text.str();
-
 		// Tell X we've got the selection.
 		XSetSelectionOwner(display, XA_PRIMARY, window, event->time);
 		if (XGetSelectionOwner(display, XA_PRIMARY) != window)
 			selection_start.line = -1;
+		else {
+			int64_t first_screen_line = history->get_last_line() - displayed_lines() + 1;
+			primary_selection =
+				take_selection(
+					selection_start, selection_end, (selecting_by == SelectingByLine),
+					first_screen_line);
+			}
 		}
 }
 
 
-void TermWindow::selection_requested(XSelectionRequestEvent* event)
+void TermWindow::copy_to_clipboard(Time time)
+{
+	// Copy the selection that's showing, or if there isn't one, the last one.
+	// As with PRIMARY, only what's on the screen gets copied now; the rest
+	// stays in the history until it's asked for.
+	std::shared_ptr<OwnedSelection> selection;
+	if (has_selection()) {
+		int64_t first_screen_line = history->get_last_line() - displayed_lines() + 1;
+		selection =
+			take_selection(
+				selection_start, selection_end, (selecting_by == SelectingByLine),
+				first_screen_line);
+		}
+	else if (primary_selection && selection_is_intact(*primary_selection)) {
+		// What was on the screen then may have changed, so share what it took.
+		selection = primary_selection;
+		}
+	if (!selection)
+		return;
+
+	XSetSelectionOwner(display, clipboard_atom, window, time);
+	if (XGetSelectionOwner(display, clipboard_atom) == window)
+		clipboard_selection = selection;
+}
+
+
+std::shared_ptr<TermWindow::OwnedSelection>* TermWindow::owned_selection_for(Atom selection)
+{
+	if (selection == XA_PRIMARY)
+		return &primary_selection;
+	else if (selection == clipboard_atom)
+		return &clipboard_selection;
+	return nullptr;
+}
+
+
+std::shared_ptr<TermWindow::OwnedSelection> TermWindow::take_selection(
+	SelectionPoint start, SelectionPoint end, bool by_line,
+	int64_t snapshot_line)
+{
+	// Lines from "snapshot_line" on have their text copied now; the ones before
+	// it just have their versions recorded.
+	std::shared_ptr<OwnedSelection> selection = std::make_shared<OwnedSelection>();
+	selection->start = start;
+	selection->end = end;
+	selection->by_line = by_line;
+	if (snapshot_line < start.line)
+		snapshot_line = start.line;
+	if (snapshot_line > end.line + 1)
+		snapshot_line = end.line + 1;
+	selection->snapshot_line = snapshot_line;
+	for (int64_t which_line = start.line; which_line < snapshot_line; ++which_line)
+		selection->line_versions.push_back(history->line(which_line)->version);
+	SelectionTransfer transfer;
+	transfer.selection = selection;
+	transfer.next_line = snapshot_line;
+	transfer.text_offset = 0;
+	while (get_selection_text(&transfer, SIZE_MAX) == SelectionTextMore)
+		;
+	selection->text.swap(transfer.pending);
+	selection->text_taken = true;
+	return selection;
+}
+
+
+bool TermWindow::selection_is_intact(const OwnedSelection& selection)
+{
+	if (selection.line_versions.empty())
+		return true;
+	if (selection.start.line < history->get_first_line())
+		return false;
+	int64_t which_line = selection.start.line;
+	for (uint64_t version: selection.line_versions) {
+		if (history->line(which_line++)->version != version)
+			return false;
+		}
+	return true;
+}
+
+
+void TermWindow::give_up_selection(Atom selection)
+{
+	if (XGetSelectionOwner(display, selection) == window)
+		XSetSelectionOwner(display, selection, None, CurrentTime);
+	std::shared_ptr<OwnedSelection>* owned_selection = owned_selection_for(selection);
+	if (owned_selection)
+		owned_selection->reset();
+}
+
+
+int TermWindow::get_selection_text(SelectionTransfer* transfer, size_t max_bytes)
 {
-	// We send the whole selection at once, even if it's big.  The ICCCM says we
-	// should use the "large data transfer" protocol if the selection is larger
-	// than XMaxRequestSize(display), but we don't do that yet.
+	// Appends to "transfer->pending" until it has at least "max_bytes" (or
+	// there's no more).  The recorded lines come from the History, a line at a
+	// time; it's an error if any of them have changed.
+	const OwnedSelection& selection = *transfer->selection;
+	std::string* text = &transfer->pending;
+	while (transfer->next_line < selection.snapshot_line && text->size() < max_bytes) {
+		int64_t which_line = transfer->next_line;
+		uint64_t version = selection.line_versions[which_line - selection.start.line];
+		if (which_line < history->get_first_line() || history->line(which_line)->version != version)
+			return SelectionTextChanged;
+		*text +=
+			history->line(which_line)->characters_from_to(
+				which_line == selection.start.line ? selection.start.column : 0,
+				which_line == selection.end.line ? selection.end.column : INT_MAX);
+		if (which_line != selection.end.line || selection.by_line)
+			*text += '\n';
+		transfer->next_line += 1;
+		}
+	if (transfer->next_line < selection.snapshot_line)
+		return SelectionTextMore;
+
+	// The copied text.  When taking the selection, this is also what fills it
+	// in.
+	if (!selection.text_taken) {
+		for (; transfer->next_line <= selection.end.line && text->size() < max_bytes; transfer->next_line += 1) {
+			int64_t which_line = transfer->next_line;
+			*text +=
+				history->line(which_line)->characters_from_to(
+					which_line == selection.start.line ? selection.start.column : 0,
+					which_line == selection.end.line ? selection.end.column : INT_MAX);
+			if (which_line != selection.end.line || selection.by_line)
+				*text += '\n';
+			}
+		return (transfer->next_line <= selection.end.line ? SelectionTextMore : SelectionTextDone);
+		}
+	if (text->size() < max_bytes && transfer->text_offset < selection.text.size()) {
+		size_t length = selection.text.size() - transfer->text_offset;
+		if (length > max_bytes - text->size())
+			length = max_bytes - text->size();
+		text->append(selection.text, transfer->text_offset, length);
+		transfer->text_offset += length;
+		}
+	return (transfer->text_offset < selection.text.size() ? SelectionTextMore : SelectionTextDone);
+}
+
 
+void TermWindow::selection_requested(XSelectionRequestEvent* event)
+{
 	XSelectionEvent response;
 	response.type = SelectionNotify;
 	response.requestor = event->requestor;
@@ -902,32 +1779,63 @@ void TermWindow::selection_requested(XSelectionRequestEvent* event)
 	response.time = event->time;
 	response.property = None; 	// Default: reject.
 
-	Atom targets_atom = XInternAtom(display, "TARGETS", 0);
-	if (event->target == targets_atom) {
+	std::shared_ptr<OwnedSelection>* owned_selection = owned_selection_for(event->selection);
+	std::shared_ptr<OwnedSelection> selection;
+	if (owned_selection)
+		selection = *owned_selection;
+	if (selection && !selection_is_intact(*selection)) {
+		// What was selected isn't there anymore.
+		give_up_selection(event->selection);
+		selection.reset();
+		}
+	Atom property = event->property;
+	if (property == None)
+		property = event->target;
+	trap_x_errors();
+	if (!selection) {
+		// We don't have it (anymore).
+		}
+	else if (event->target == targets_atom) {
 		// Respond with the supported type.
 		XChangeProperty(
-			event->display, event->requestor, event->property,
+			event->display, event->requestor, property,
 			XA_ATOM, 32, PropModeReplace,
 			(unsigned char*) &target_atom, 1);
-		response.property = event->property;
+		response.property = property;
 		}
 	else if (event->target == target_atom || event->target == XA_STRING) {
-		if (event->selection == XA_PRIMARY) {
-			if (!selected_text.empty()) {
-				Atom property = event->property;
-				if (property == None)
-					property = event->target;
-				XChangeProperty(
-					event->display, event->requestor, property, event->target,
-					8, PropModeReplace,
-					(unsigned char*) selected_text.data(), selected_text.size());
-				response.property = event->property;
-				}
+		SelectionTransfer transfer;
+		transfer.requestor = event->requestor;
+		transfer.selection_atom = event->selection;
+		transfer.property = property;
+		transfer.type = event->target;
+		transfer.selection = selection;
+		transfer.next_line = selection->start.line;
+		transfer.text_offset = 0;
+		int status = get_selection_text(&transfer, selection_chunk_size + 1);
+		if (status == SelectionTextDone && transfer.pending.size() <= selection_chunk_size) {
+			// It all fits; send it at once.
+			XChangeProperty(
+				event->display, event->requestor, property, event->target,
+				8, PropModeReplace,
+				(unsigned char*) transfer.pending.data(), transfer.pending.size());
 			}
 		else {
-			// We don't currently handle other types of selection.
-			return;
+			// Too big; it'll have to go in pieces.  The requestor starts the
+			// transfer by deleting the property, and each time it deletes it
+			// after that, we send the next piece.  The size we give is a lower
+			// bound, as the ICCCM allows; we don't know the total yet.  We also
+			// watch for the requestor going away before it's done.
+			XSelectInput(display, event->requestor, PropertyChangeMask | StructureNotifyMask);
+			long size_lower_bound = transfer.pending.size();
+			XChangeProperty(
+				event->display, event->requestor, property, incr_atom,
+				32, PropModeReplace,
+				(unsigned char*) &size_lower_bound, 1);
+			transfer.last_activity_ms = monotonic_ms();
+			selection_transfers.push_back(transfer);
 			}
+		response.property = property;
 		}
 
 	// Send the reply.
@@ -935,12 +1843,138 @@ void TermWindow::selection_requested(XSelectionRequestEvent* event)
 		XSendEvent(event->display, event->requestor, true, 0, (XEvent*) &response);
 	if (!result)
 		fprintf(stderr, "Error sending SelectionNotify event.\n");
+	if (untrap_x_errors()) {
+		// The requestor is already gone.
+		drop_selection_transfers(event->requestor, false);
+		}
+}
+
+
+void TermWindow::continue_selection_transfer(XPropertyEvent* event)
+{
+	if (event->state != PropertyDelete)
+		return;
+	auto transfer = selection_transfers.begin();
+	for (; transfer != selection_transfers.end(); ++transfer) {
+		if (transfer->requestor == event->window && transfer->property == event->atom)
+			break;
+		}
+	if (transfer == selection_transfers.end())
+		return;
+
+	// Send the next piece.  An empty one means we're done.  If the selected
+	// lines have changed in the meantime, we stop there, and give up the
+	// selection.
+	if (transfer->pending.size() < selection_chunk_size) {
+		int status = get_selection_text(&*transfer, selection_chunk_size);
+		if (status == SelectionTextChanged) {
+			transfer->pending.clear();
+			if (*owned_selection_for(transfer->selection_atom) == transfer->selection)
+				give_up_selection(transfer->selection_atom);
+			}
+		}
+	size_t chunk_size = transfer->pending.size();
+	if (chunk_size > selection_chunk_size)
+		chunk_size = selection_chunk_size;
+	Window requestor = transfer->requestor;
+	trap_x_errors();
+	XChangeProperty(
+		display, requestor, transfer->property, transfer->type,
+		8, PropModeReplace,
+		(unsigned char*) transfer->pending.data(), chunk_size);
+	if (untrap_x_errors()) {
+		drop_selection_transfers(requestor, false);
+		return;
+		}
+	transfer->pending.erase(0, chunk_size);
+	transfer->last_activity_ms = monotonic_ms();
+	if (chunk_size == 0) {
+		selection_transfers.erase(transfer);
+		bool requestor_has_more = false;
+		for (auto& other_transfer: selection_transfers) {
+			if (other_transfer.requestor == requestor)
+				requestor_has_more = true;
+			}
+		if (!requestor_has_more) {
+			trap_x_errors();
+			XSelectInput(display, requestor, NoEventMask);
+			untrap_x_errors();
+			}
+		}
+}
+
+
+void TermWindow::drop_selection_transfers(Window requestor, bool requestor_exists)
+{
+	bool dropped_any = false;
+	for (auto transfer = selection_transfers.begin(); transfer != selection_transfers.end(); ) {
+		if (transfer->requestor == requestor) {
+			transfer = selection_transfers.erase(transfer);
+			dropped_any = true;
+			}
+		else
+			++transfer;
+		}
+	if (dropped_any && requestor_exists) {
+		trap_x_errors();
+		XSelectInput(display, requestor, NoEventMask);
+		untrap_x_errors();
+		}
+}
+
+
+void TermWindow::expire_selection_transfers()
+{
+	// Requestors that stopped asking for more (without going away) don't get
+	// to hold on to their selections forever.
+	uint64_t now = monotonic_ms();
+	for (size_t i = 0; i < selection_transfers.size(); ) {
+		const SelectionTransfer& transfer = selection_transfers[i];
+		if (now >= transfer.last_activity_ms + selection_transfer_timeout_ms) {
+			// This drops all of the requestor's transfers, so start over.
+			drop_selection_transfers(transfer.requestor, true);
+			i = 0;
+			}
+		else
+			i += 1;
+		}
+}
+
+
+uint64_t TermWindow::next_selection_transfer_expiry_ms()
+{
+	uint64_t expiry_ms = UINT64_MAX;
+	for (auto& transfer: selection_transfers) {
+		uint64_t transfer_expiry_ms = transfer.last_activity_ms + selection_transfer_timeout_ms;
+		if (transfer_expiry_ms < expiry_ms)
+			expiry_ms = transfer_expiry_ms;
+		}
+	return expiry_ms;
+}
+
+
+void TermWindow::trap_x_errors()
+{
+	XSync(display, False);
+	x_error_caught = false;
+	untrapped_x_error_handler = XSetErrorHandler(trapped_x_error_handler);
+}
+
+
+bool TermWindow::untrap_x_errors()
+{
+	// Returns whether any errors happened since trap_x_errors().
+	XSync(display, False);
+	XSetErrorHandler(untrapped_x_error_handler);
+	return x_error_caught;
 }
 
 
 void TermWindow::property_changed(XEvent* event)
 {
-	if (event->xproperty.state == PropertyNewValue && event->xproperty.atom == XA_PRIMARY) {
+	bool is_selection_property =
+		event->xproperty.atom == XA_PRIMARY || event->xproperty.atom == clipboard_atom;
+	if (event->xproperty.state == PropertyNewValue && is_selection_property) {
 		// This is a continuation of a selection transfer.
 		received_selection(event);
 		}
@@ -957,8 +1991,6 @@ void TermWindow::received_selection(XEvent* event)
 	if (property == None)
 		return;
 
-	Atom incr_atom = XInternAtom(display, "INCR", 0);
-
 	long offset = 0;
 	unsigned long bytes_left = 0;
 	do {
@@ -982,6 +2014,9 @@ void TermWindow::received_selection(XEvent* event)
 			// longer need to receive PropertyNotify events.
 			attributes.event_mask &= ~PropertyChangeMask;
 			XChangeWindowAttributes(display, window, CWEventMask, &attributes);
+			if (receiving_incr_paste && bracketing_paste)
+				terminal->send("\x1B[201~");
+			receiving_incr_paste = false;
 			}
 
 		if (type == incr_atom) {
@@ -989,8 +2024,20 @@ void TermWindow::received_selection(XEvent* event)
 			// We need get the rest of the parts via PropertyNotify events.
 			attributes.event_mask |= PropertyChangeMask;
 			XChangeWindowAttributes(display, window, CWEventMask, &attributes);
+			receiving_incr_paste = true;
+			bracketing_paste = history->use_bracketed_paste;
+			if (bracketing_paste)
+				terminal->send("\x1B[200~");
 			// Signal transfer start by deleting the property.
 			XDeleteProperty(display, window, property);
+			XFree(data);
+			return;
+			}
+
+		if (event->type == SelectionNotify && offset == 0) {
+			bracketing_paste = history->use_bracketed_paste;
+			if (bracketing_paste)
+				terminal->send("\x1B[200~");
 			}
 
 		// Convert '\n' to '\r'.
@@ -1003,104 +2050,64 @@ void TermWindow::received_selection(XEvent* event)
 			}
 
 		// Send to the client.
-		if (history->use_bracketed_paste)
-			terminal->send("\x1B[200~");
 		terminal->send((const char*) data, num_bytes);
-		if (history->use_bracketed_paste)
-			terminal->send("\x1B[201~");
 
 		XFree(data);
 		// Offset is in 32-bit quantities, not bytes.
 		offset += num_items * format / 32;
 	} while (bytes_left > 0);
+	if (event->type == SelectionNotify && bracketing_paste)
+		terminal->send("\x1B[201~");
 
 	// Delete the property to let the selection owner know we're ready for the
-	// next chunk.
-	XDeleteProperty(display, window, property);
+	// next chunk.  If the child is behind, that waits until it catches up.
+	if (receiving_incr_paste && terminal->output_size() > max_paste_backlog)
+		held_paste_property = property;
+	else
+		XDeleteProperty(display, window, property);
 }
 
 
-void TermWindow::paste()
+void TermWindow::resume_paste()
 {
-	XConvertSelection(
-		display, XA_PRIMARY, target_atom, XA_PRIMARY, window, CurrentTime);
+	if (held_paste_property == None || terminal->output_size() > max_paste_backlog)
+		return;
+	XDeleteProperty(display, window, held_paste_property);
+	held_paste_property = None;
 }
 
 
-int TermWindow::column_for_pixel(int64_t which_line, int x)
+void TermWindow::paste(Atom selection)
 {
-	Line* line = history->line(which_line);
-	int column = 0;
-	int cur_column_width = 0;
-	int which_column = 0;
-	XGlyphInfo glyph_info;
-	int initial_x = x;
-	bool in_initial_spaces = settings.synthetic_tab_spaces > 0;
-	for (auto run: *line) {
-		// Tab.
-		if (run->is_tab) {
-			int tab_width = 0;
-			if (line->elastic_tabs) {
-				int column_width =
-					line->elastic_tabs->column_widths[which_column];
-				tab_width =
-					column_width - cur_column_width + settings.column_separation;
-				}
-			else {
-				tab_width = settings.tab_width - ((initial_x - x) % settings.tab_width);
-				// Make sure we always have at least the width of a space.
-				XftTextExtentsUtf8(
-					display, xft_font_for(run->style),
-					(const FcChar8*) " ", 1, &glyph_info);
-				if (tab_width < glyph_info.xOff)
-					tab_width += settings.tab_width;
-				}
-
-			if (x < tab_width / 2)
-				return column;
-			x -= tab_width;
-			column += 1;
-
-			// Start the next column.
-			which_column += 1;
-			cur_column_width = 0;
+	XConvertSelection(
+		display, selection, target_atom, selection, window, CurrentTime);
+}
 
-			in_initial_spaces = false;
-			continue;
-			}
 
-		const char* p = run->bytes();
-		const char* end = p + strlen(p);
-		while (p < end) {
-			int char_num_bytes = UTF8::bytes_for_n_characters(p, end - p, 1);
-			XftTextExtentsUtf8(
-				display, xft_font_for(run->style),
-				(const FcChar8*) p, char_num_bytes, &glyph_info);
-			int char_width = glyph_info.xOff;
+void TermWindow::scroll_view(int64_t num_lines)
+{
+	// Negative "num_lines" scrolls up (back into the history).  draw() will
+	// move the rows that are still visible, and only render the ones that
+	// scrolled into view.
+	int64_t old_top_line = top_line;
+	int64_t bottom_top_line = history->get_last_line() - displayed_lines() + 1;
+	int64_t new_top_line = calc_effective_top_line() + num_lines;
+	if (new_top_line < history->get_first_line())
+		new_top_line = history->get_first_line();
+	if (new_top_line >= bottom_top_line) {
+		// We've reached the end.
+		scroll_to_bottom();
+		}
+	else
+		top_line = new_top_line;
+	if (top_line != old_top_line)
+		needs_draw = true;
+}
 
-			// Handle synthetic tabs.
-			if (in_initial_spaces) {
-				if (*p == ' ') {
-					int width_handled = initial_x - x;
-					int width_needed =
-						((column + 1) / settings.synthetic_tab_spaces) *
-						settings.tab_width;
-					if (width_needed > width_handled)
-						char_width = width_needed - width_handled;
-					}
-				else
-					in_initial_spaces = false;
-				}
 
-			if (x < char_width / 2)
-				return column;
-			x -= char_width;
-			cur_column_width += char_width;
-			column += 1;
-			p += char_num_bytes;
-			}
-		}
-	return column;
+int TermWindow::column_for_pixel(int64_t which_line, int x)
+{
+	return layout_for(history->line(which_line))->column_for_x(x);
 }
 
 
@@ -1163,76 +2170,102 @@ TermWindow::SelectionPoint TermWindow::end_of_word(SelectionPoint point)
 }
 
 
-void TermWindow::recalc_elastic_columns(int64_t initial_line)
+void TermWindow::recalc_elastic_columns(ElasticTabs* elastic_tabs)
 {
-	Line* line = history->line(initial_line);
-	if (line == nullptr || line->elastic_tabs == nullptr)
-		return;
-	ElasticTabs* elastic_tabs = line->elastic_tabs;
+	// Only the lines that changed need to be measured again; the rest of the
+	// group's widths are already counted.  The ones that are shown will be
+	// drawn, so they keep their full layouts; the others only need widths.
+	int64_t first_shown_line = shown_first_line;
+	if (first_shown_line < history->get_first_line())
+		first_shown_line = history->get_first_line();
+	int64_t last_shown_line = shown_last_line;
+	if (last_shown_line > history->get_last_line())
+		last_shown_line = history->get_last_line();
+	for (int64_t which_line = first_shown_line; which_line <= last_shown_line; ++which_line) {
+		Line* line = history->line(which_line);
+		if (line->elastic_tabs == elastic_tabs && elastic_tabs->dirty_lines.erase(line) > 0)
+			elastic_tabs->set_line_widths(line, measured_layout_for(line, true)->segment_widths);
+		}
+	for (Line* line: elastic_tabs->dirty_lines)
+		elastic_tabs->set_line_widths(line, measured_layout_for(line, false)->segment_widths);
+	elastic_tabs->dirty_lines.clear();
+	elastic_tabs->update_column_widths();
+}
 
-	// Recalculate from scratch using all lines in the group, unless we only had
-	// added characters.
-	if (elastic_tabs->first_dirty_line == 0)
-		elastic_tabs->column_widths.clear();
 
-	// First, go backwards from initial_line.
+void TermWindow::elastic_fonts_changed(int64_t initial_line)
+{
+	// Every line in the group needs to be measured again.  The group's lines
+	// are the ones around "initial_line" that share it.
+	ElasticTabs* elastic_tabs = history->line(initial_line)->elastic_tabs;
+	elastic_tabs->fonts_changed(font_generation);
 	int64_t which_line = initial_line;
 	for (; which_line >= history->get_first_line(); --which_line) {
-		Line* cur_line = history->line(which_line);
-		if (cur_line->elastic_tabs != elastic_tabs)
-			break;
-		if (which_line < elastic_tabs->first_dirty_line)
+		Line* line = history->line(which_line);
+		if (line->elastic_tabs != elastic_tabs)
 			break;
-		update_elastic_columns_for(cur_line);
+		elastic_tabs->line_changed(line);
 		}
-
-	// Then go forward from the initial_line.
 	which_line = initial_line + 1;
 	for (; which_line <= history->get_last_line(); ++which_line) {
-		Line* cur_line = history->line(which_line);
-		if (cur_line->elastic_tabs != elastic_tabs)
+		Line* line = history->line(which_line);
+		if (line->elastic_tabs != elastic_tabs)
 			break;
-		update_elastic_columns_for(cur_line);
+		elastic_tabs->line_changed(line);
 		}
-
-	elastic_tabs->undirtify();
 }
 
 
-void TermWindow::update_elastic_columns_for(Line* line)
+void TermWindow::recalc_visible_elastic_columns(int64_t first_line, int64_t last_line)
 {
-	if (line == nullptr || line->elastic_tabs == nullptr)
+	// Only lines from "first_line" to "last_line" get measured; lines elsewhere
+	// in their groups stay dirty until they come into range.  Lines keep what
+	// they contributed when they go out of range, so the columns don't shrink
+	// just from scrolling.
+	// When the fonts change, each group starts over, and its lines are measured
+	// again as they come into range.
+	if (first_line < history->get_first_line())
+		first_line = history->get_first_line();
+	if (last_line > history->get_last_line())
+		last_line = history->get_last_line();
+
+	// If nothing has changed since last time, there's nothing to do.
+	bool unchanged =
+		first_line == elastic_scan.first_line && last_line == elastic_scan.last_line &&
+		ElasticTabs::change_count == elastic_scan.change_count &&
+		font_generation == elastic_scan.font_generation;
+	if (unchanged)
 		return;
-	ElasticTabs* elastic_tabs = line->elastic_tabs;
 
-	std::vector<int>::size_type which_column = 0;
-	int column_width = 0;
-	for (auto run: *line) {
-		if (run->is_tab) {
-			// Finish this column.
-			if (elastic_tabs->column_widths.size() <= which_column)
-				elastic_tabs->column_widths.push_back(column_width);
-			else if (column_width > elastic_tabs->column_widths[which_column])
-				elastic_tabs->column_widths[which_column] = column_width;
-			which_column += 1;
-			column_width = 0;
+	std::vector<ElasticTabs*> groups;
+	for (int64_t which_line = first_line; which_line <= last_line; ++which_line) {
+		Line* line = history->line(which_line);
+		ElasticTabs* elastic_tabs = line->elastic_tabs;
+		if (elastic_tabs == nullptr)
 			continue;
+		if (elastic_tabs->font_generation != font_generation)
+			elastic_tabs->fonts_changed(font_generation);
+		bool needs_measuring = elastic_tabs->dirty_lines.erase(line) > 0;
+		if (line->elastic_widths_font_generation != elastic_tabs->font_generation)
+			needs_measuring = true;
+		if (needs_measuring) {
+			// Lines in the margin only need their widths.
+			bool is_shown = which_line >= shown_first_line && which_line <= shown_last_line;
+			elastic_tabs->set_line_widths(
+				line, measured_layout_for(line, is_shown)->segment_widths);
 			}
-
-		// Incorporate this run into the current column width;
-		XGlyphInfo glyph_info;
-		const char* run_bytes = run->bytes();
-		XftTextExtentsUtf8(
-			display, xft_font_for(run->style),
-			(const FcChar8*) run_bytes, strlen(run_bytes), &glyph_info);
-		column_width += glyph_info.xOff;
+		if (elastic_tabs->is_dirty && (groups.empty() || groups.back() != elastic_tabs))
+			groups.push_back(elastic_tabs);
+		}
+	for (auto elastic_tabs: groups) {
+		if (elastic_tabs->is_dirty)
+			elastic_tabs->update_column_widths();
 		}
 
-	// Finish the last column.
-	if (elastic_tabs->column_widths.size() <= which_column)
-		elastic_tabs->column_widths.push_back(column_width);
-	else if (column_width > elastic_tabs->column_widths[which_column])
-		elastic_tabs->column_widths[which_column] = column_width;
+	elastic_scan.first_line = first_line;
+	elastic_scan.last_line = last_line;
+	elastic_scan.change_count = ElasticTabs::change_count;
+	elastic_scan.font_generation = font_generation;
 }
 
 
@@ -6,15 +6,23 @@
 
 #include "Style.h"
 #include "FontSet.h"
+#include "DrawBatch.h"
+#include "LineTileCache.h"
+#include "Presenter.h"
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 #include <string>
+#include <vector>
+#include <map>
+#include <memory>
 #include <time.h>
 #include <stdint.h>
 
 class Terminal;
 class History;
 class Line;
+class ElasticTabs;
+class LineLayout;
 
 
 class TermWindow {
@@ -27,6 +35,10 @@ class TermWindow {
 		void	draw();
 		void	resized(unsigned int new_width, unsigned int new_height);
 		void	set_title(const char* title);
+		void	lines_scrolled(int64_t top_line, int64_t bottom_line, int num_lines);
+			// Called by the History when lines "top_line" through "bottom_line" are
+			// scrolled up by "num_lines" (down, if negative).
+		void	synchronized_output_changed();
 
 	protected:
 		bool	closed;
@@ -38,6 +50,10 @@ class TermWindow {
 		XSetWindowAttributes attributes;
 		GC gc;
 		Drawable pixmap;
+		unsigned int	pixmap_width = 0, pixmap_height = 0;
+		enum {
+			pixmap_size_bucket = 128,
+			};
 		XftDraw* xft_draw;
 		FontSet* regular_font = nullptr;
 		FontSet* line_drawing_font = nullptr;
@@ -45,9 +61,129 @@ class TermWindow {
 		unsigned int width, height;
 		double font_size_override = 0;
 		bool use_monospace_font = false;
+		uint64_t	font_generation = 0;
+			// Changes whenever the fonts do, so cached measurements can be
+			// recognized as stale.
 
 		int64_t top_line;
 
+		// What was last drawn on each row of the pixmap, so only rows that have
+		// changed get redrawn.
+		struct DrawnRow {
+			enum {
+				unknown_version = UINT64_MAX,
+				};
+			uint64_t	line_version; 	// 0: blank row.
+			ElasticTabs*	elastic_tabs;
+			uint64_t	elastic_tabs_generation;
+			int	selection_start, selection_end; 	// -1: no selection on this row.
+
+			DrawnRow()
+				: line_version(unknown_version), elastic_tabs(nullptr),
+				elastic_tabs_generation(0),
+				selection_start(-1), selection_end(-1) {}
+			bool	operator==(const DrawnRow& other) const {
+				return
+					line_version == other.line_version &&
+					elastic_tabs == other.elastic_tabs &&
+					elastic_tabs_generation == other.elastic_tabs_generation &&
+					selection_start == other.selection_start &&
+					selection_end == other.selection_end;
+				}
+			};
+		std::vector<DrawnRow>	drawn_rows;
+		int64_t	drawn_top_line;
+		int64_t	shown_first_line = 0, shown_last_line = -1;
+		void	trim_hidden_layouts(int64_t first_line, int64_t last_line);
+		void	invalidate_rows() { drawn_rows.clear(); }
+
+		// Scrolls reported by the History since the last draw().  Rather than
+		// redrawing them, we move what's already in the pixmap.
+		struct PendingScroll {
+			int64_t	top_line, bottom_line;
+			int	num_lines;
+			};
+		std::vector<PendingScroll>	pending_scrolls;
+		enum {
+			max_pending_scrolls = 64,
+			};
+		void	shift_rows(int64_t first_row, int64_t last_row, int64_t num_rows);
+
+		// Frame scheduling.  Output from the terminal only requests a draw; it
+		// happens right away unless we've drawn too recently, in which case it
+		// waits for the next frame.
+		bool	needs_draw = false;
+		uint64_t	last_draw_ms = 0;
+		uint64_t	next_frame_ms();
+
+		// tick() waits for everything with one epoll_wait(); timeouts (frames,
+		// blinking, resize notification) come from "timer_fd".
+		int	epoll_fd;
+		int	timer_fd;
+		uint64_t	timer_deadline_ms = 0;
+		bool	watching_terminal_output = false;
+		enum {
+			max_wakeup_events = 8,
+			};
+		void	set_timer(uint64_t deadline_ms);
+
+		// Size changes are passed on to the terminal at most every
+		// "resize_notify_interval_ms", so resizing the window doesn't send the
+		// child a storm of SIGWINCHes.
+		enum {
+			resize_notify_interval_ms = 100,
+			};
+		bool	resize_pending = false;
+		int	resize_columns = 0, resize_rows = 0;
+		uint64_t	last_resize_notify_ms = 0;
+		void	notify_resize();
+
+		// While the program has synchronized output on, it's in the middle of
+		// updating the screen, so we don't draw until it's done (or gives up).
+		enum {
+			synchronized_output_timeout_ms = 200,
+			};
+		uint64_t	synchronized_output_start_ms = 0;
+		uint64_t	synchronized_output_end_ms() {
+			return synchronized_output_start_ms + synchronized_output_timeout_ms;
+			}
+#ifdef SHOW_STARTUP_TIME
+		uint64_t	startup_ms;
+#endif
+
+		// Drawing is suspended while the window is unmapped or completely
+		// covered; the terminal keeps reading output in the meantime.
+		bool	mapped = true, obscured = false;
+		bool	is_visible() { return mapped && !obscured; }
+
+		DrawBatch	draw_batch;
+
+		// The cursor isn't part of the rows; it's drawn over them after they're
+		// drawn, with what was under it saved in "cursor_backup".  So moving or
+		// blinking it only involves its own cell.
+		struct DrawnCursor {
+			bool	shown;
+			XRectangle	rect;
+			};
+		DrawnCursor	drawn_cursor = { false, { 0, 0, 0, 0 } };
+		Pixmap	cursor_backup = None;
+		int	cursor_backup_width = 0, cursor_backup_height = 0;
+		bool	cursor_blink_on = true;
+		uint64_t	next_blink_ms = 0;
+		int64_t	blink_cursor_line = -1;
+		int	blink_cursor_column = -1;
+		bool	cursor_blinks();
+		void	draw_cursor();
+		void	remove_cursor();
+		void	blink_cursor();
+		LineTileCache*	line_tiles;
+
+		// Damaged areas of the pixmap that need to be copied to the window.
+		std::vector<XRectangle>	damage;
+		void	add_damage(int x, int y, int width, int height);
+		void	present();
+		Presenter*	presenter;
+
 		struct SelectionPoint {
 			int64_t	line;
 			int	column;
@@ -56,12 +192,12 @@ class TermWindow {
 				: line(-1), column(0) {}
 			SelectionPoint(int64_t line_in, int column_in)
 				: line(line_in), column(column_in) {}
-			bool operator<(SelectionPoint& other) {
+			bool operator<(const SelectionPoint& other) const {
 				return
 					line < other.line ||
 					(line == other.line && column < other.column);
 				}
-			bool	operator>=(SelectionPoint& other) {
+			bool	operator>=(const SelectionPoint& other) const {
 				return !(*this < other);
 				}
 			};
@@ -76,14 +212,74 @@ class TermWindow {
 			};
 		int	selecting_by;
 		struct timespec	last_click_time;
-		std::string selected_text;
 		void	clear_selection() {
 			selection_start.line = selection_end.line = -1;
 			}
 
+		// The selections we own (PRIMARY and CLIPBOARD).  Lines in the
+		// scrollback don't change (they only go away), so PRIMARY only copies
+		// the text of the lines still on the screen; the rest is recorded by
+		// line and version, and comes straight from the History when someone
+		// asks for it.  If any of those lines have changed by then, we give up
+		// the selection rather than send something that wasn't selected.
+		// CLIPBOARD, being an explicit copy, copies all its text.  Big
+		// selections are sent in pieces (the ICCCM "INCR" protocol).
+		struct OwnedSelection {
+			SelectionPoint	start, end;
+			bool	by_line;
+			std::vector<uint64_t>	line_versions;
+				// For the lines from "start.line" up to "snapshot_line".
+			int64_t	snapshot_line;
+			std::string	text;
+				// The text from "snapshot_line" to the end.
+			bool	text_taken;
+
+			OwnedSelection()
+				: by_line(false), snapshot_line(0), text_taken(false) {}
+			};
+		std::shared_ptr<OwnedSelection>	primary_selection, clipboard_selection;
+		std::shared_ptr<OwnedSelection>*	owned_selection_for(Atom selection);
+		std::shared_ptr<OwnedSelection>	take_selection(
+			SelectionPoint start, SelectionPoint end, bool by_line,
+			int64_t snapshot_line);
+		bool	selection_is_intact(const OwnedSelection& selection);
+		void	give_up_selection(Atom selection);
+		struct SelectionTransfer {
+			Window	requestor;
+			Atom	selection_atom, property, type;
+			std::shared_ptr<OwnedSelection>	selection;
+			int64_t	next_line;
+			size_t	text_offset;
+			std::string	pending;
+			uint64_t	last_activity_ms;
+			};
+		std::vector<SelectionTransfer>	selection_transfers;
+		size_t	selection_chunk_size;
+		enum {
+			max_selection_chunk_size = 256 * 1024,
+			// Transfers whose requestors stop asking for more are dropped.
+			selection_transfer_timeout_ms = 30 * 1000,
+			};
+		enum {
+			SelectionTextDone, SelectionTextMore, SelectionTextChanged,
+			};
+		int	get_selection_text(SelectionTransfer* transfer, size_t max_bytes);
+		void	continue_selection_transfer(XPropertyEvent* event);
+		void	drop_selection_transfers(Window requestor, bool requestor_exists);
+		void	expire_selection_transfers();
+		uint64_t	next_selection_transfer_expiry_ms();
+		// The requestor's window can go away at any time, which makes requests on
+		// it fail with BadWindow; those are trapped instead of being fatal.
+		void	trap_x_errors();
+		bool	untrap_x_errors();
+		void	copy_to_clipboard(Time time);
+
 		Atom wm_delete_window_atom;
 		Atom wm_name_atom;
 		Atom target_atom;
+		Atom clipboard_atom;
+		Atom incr_atom;
+		Atom targets_atom;
 
 		struct KeyMapping {
 			KeySym	keySym;
@@ -97,14 +293,21 @@ class TermWindow {
 			KeySym key_sym, unsigned int state,
 			const KeyMapping* key_mappings, int num_key_mappings);
 
-		XftFont*	xft_font_for(const Style& style) {
+		GlyphCache*	glyph_cache_for(const Style& style) {
 			return
 				(use_monospace_font ? monospace_font :
-				 ((style.line_drawing ? line_drawing_font : regular_font)))->xft_font_for(style);
+				 ((style.line_drawing ? line_drawing_font : regular_font)))->glyph_cache_for(style);
 			}
 
+		// FontSets are kept (by spec and size) once they're opened, so changing
+		// the font size back and forth doesn't need to open them again.
+		std::map<std::string, FontSet*>	font_sets;
+		FontSet*	font_set_for(const std::string& spec, bool skip_italics = false);
 		void	setup_fonts();
 		void	cleanup_fonts();
+		void	save_font_metrics();
+			// The FontSets save them when they're deleted too, but there's no
+			// need to wait that long.
 		void	screen_size_changed();
 		void	key_down(XKeyEvent* event);
 		void	mouse_button_down(XButtonEvent* event);
@@ -115,9 +318,23 @@ class TermWindow {
 		void	received_selection(XEvent* event);
 		int	displayed_lines() { return (height - 2 * settings.border) / regular_font->height(); }
 		void	scroll_to_bottom() { top_line = -1; }
+		void	scroll_view(int64_t num_lines);
+		void	draw_line(int64_t which_line, int y);
+		LineLayout*	layout_for(Line* line);
+		LineLayout*	measured_layout_for(Line* line, bool need_cells = true);
+		void	position_line(Line* line, LineLayout* layout);
 		void	decorate_run(Style style, int x, int width, int y);
 
-		void	paste();
+		void	paste(Atom selection);
+		// An incremental paste asks for each piece after the last is taken, but
+		// not until the child has read most of what it's been sent already.
+		bool	receiving_incr_paste = false;
+		bool	bracketing_paste = false;
+		Atom	held_paste_property = None;
+		enum {
+			max_paste_backlog = 256 * 1024,
+			};
+		void	resume_paste();
 
 		int	column_for_pixel(int64_t which_line, int x);
 		int64_t	calc_effective_top_line();
@@ -125,8 +342,14 @@ class TermWindow {
 		SelectionPoint	end_of_word(SelectionPoint point);
 
 		// Elastic tabs.
-		void	recalc_elastic_columns(int64_t initial_line);
-		void	update_elastic_columns_for(Line* line);
+		void	recalc_elastic_columns(ElasticTabs* elastic_tabs);
+		void	recalc_visible_elastic_columns(int64_t first_line, int64_t last_line);
+		struct {
+			int64_t	first_line = 0, last_line = -1;
+			uint64_t	change_count = 0, font_generation = 0;
+			}	elastic_scan;
+			// What recalc_visible_elastic_columns() last looked at.
+		void	elastic_fonts_changed(int64_t initial_line);
 	};
 
 
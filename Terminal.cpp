@@ -3,24 +3,34 @@
 #include "Settings.h"
 #include <pty.h>
 #include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/types.h>
 #include <pwd.h>
-#include <time.h>
 #include <stdexcept>
 
 
-// Because we can't pass a parameter to the signal handler, we can't really
-// handle more than one terminal in our process without adding extra mechanism.
-bool Terminal::child_died = false;
-
-
 Terminal::Terminal(History* history_in)
-	: history(history_in), child_pid(0)
+	: history(history_in), child_pid(0), child_died(false), pty_closed(false),
+	outgoing_start(0)
 {
 	buffer = (char*) malloc(BUFSIZ);
 	prebuffered_bytes = 0;
 
+	// SIGCHLD comes to us through "signal_fd" rather than a handler.  For that,
+	// it has to be blocked in every thread, so this has to happen before any
+	// threads are started.
+	sigset_t sigchld_set;
+	sigemptyset(&sigchld_set);
+	sigaddset(&sigchld_set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigchld_set, NULL);
+	signal_fd = signalfd(-1, &sigchld_set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0)
+		throw std::runtime_error("signalfd() failed");
+
 	int child_fd;
 	int result = openpty(&terminal_fd, &child_fd, NULL, NULL, NULL);
 	if (result < 0)
@@ -39,52 +49,69 @@ Terminal::Terminal(History* history_in)
 			throw std::runtime_error("ioctl(TIOCSCTTY) failed");
 		close(child_fd);
 		close(terminal_fd);
+		close(signal_fd);
 		exec_shell();
 		}
 	else {
 		child_pid = pid;
 		close(child_fd);
-		struct sigaction sigchld_action;
-		memset(&sigchld_action, 0, sizeof(sigchld_action));
-		sigchld_action.sa_handler = sigchld_received;
-		sigaction(SIGCHLD, &sigchld_action, NULL);
+		fcntl(terminal_fd, F_SETFL, fcntl(terminal_fd, F_GETFL) | O_NONBLOCK);
 		}
 }
 
 
 Terminal::~Terminal()
 {
+	close(signal_fd);
 	free(buffer);
 }
 
 
 bool Terminal::is_done()
 {
-	return child_died;
+	return child_died || pty_closed;
+}
+
+
+void Terminal::signal_received()
+{
+	// Several SIGCHLDs can be collapsed into one, so reap until there's nothing
+	// left.
+	struct signalfd_siginfo info;
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+		;
+	while (true) {
+		pid_t pid = waitpid(-1, NULL, WNOHANG);
+		if (pid <= 0)
+			break;
+		if (pid == child_pid)
+			child_died = true;
+		}
 }
 
 
 void Terminal::tick()
 {
-	// We assume this won't be called unless select() has indicated there is
-	// data to read.
+	// We assume this won't be called unless epoll has reported the terminal fd
+	// as readable (or hung up).
 
-	if (child_died)
+	if (is_done())
 		return;
 
 	// Read.
 	int result =
 		read(terminal_fd, buffer + prebuffered_bytes, BUFSIZ - prebuffered_bytes);
 	if (result == 0) {
-		child_died = true;
+		pty_closed = true;
 		return;
 		}
 	else if (result < 0) {
-		// Wait a moment before checking child_died again.
-		struct timespec sleep_spec = { 0, 1000000 };
-		nanosleep(&sleep_spec, nullptr);
-		if (child_died) {
-			// This is a race condition; the child died *while* we were reading.
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		else if (errno == EIO) {
+			// Everything on the child's side of the pty has closed it; there
+			// won't be any more.  (Its SIGCHLD may or may not have arrived yet.)
+			pty_closed = true;
 			return;
 			}
 		throw std::runtime_error("read() failed");
@@ -112,14 +139,47 @@ void Terminal::send(const char* data, int length)
 {
 	if (length == -1)
 		length = strlen(data);
+	if (is_done())
+		return;
+	outgoing.append(data, length);
+	flush_output();
+}
+
+
+void Terminal::flush_output()
+{
 	// st makes sure not to send more than 256 bytes at a time, because it might
-	// be connected to a modem.  We don't bother with that (currently).
-	while (length > 0) {
-		ssize_t bytes_written = write(terminal_fd, data, length);
-		if (bytes_written < 0)
+	// be connected to a modem.  We don't go that far, but we do limit how much
+	// we write before getting back to reading.
+	std::string::size_type flush_end = outgoing_start + max_flush_size;
+	while (outgoing_start < outgoing.size() && outgoing_start < flush_end) {
+		size_t length = outgoing.size() - outgoing_start;
+		if (length > max_write_size)
+			length = max_write_size;
+		ssize_t bytes_written = write(terminal_fd, outgoing.data() + outgoing_start, length);
+		if (bytes_written < 0) {
+			if (errno == EAGAIN)
+				break;
+			else if (errno == EINTR)
+				continue;
+			else if (errno == EIO) {
+				// The child has gone away; nobody is going to read this.
+				outgoing_start = outgoing.size();
+				break;
+				}
 			throw std::runtime_error("write() failed");
-		data += bytes_written;
-		length -= bytes_written;
+			}
+		outgoing_start += bytes_written;
+		}
+
+	// Don't keep what's been written.
+	if (outgoing_start >= outgoing.size()) {
+		outgoing.clear();
+		outgoing_start = 0;
+		}
+	else if (outgoing_start > outgoing.size() / 2) {
+		outgoing.erase(0, outgoing_start);
+		outgoing_start = 0;
 		}
 }
 
@@ -174,6 +234,10 @@ void Terminal::exec_shell()
 	setenv("SPFT", "true", true);
 
 	// Signals.
+	sigset_t sigchld_set;
+	sigemptyset(&sigchld_set);
+	sigaddset(&sigchld_set, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
 	signal(SIGCHLD, SIG_DFL);
 	signal(SIGHUP, SIG_DFL);
 	signal(SIGINT, SIG_DFL);
@@ -197,10 +261,4 @@ void Terminal::exec_shell()
 }
 
 
-void Terminal::sigchld_received(int signal_number)
-{
-	child_died = true;
-}
-
-
 
@@ -2,6 +2,7 @@
 #define Terminal_h
 
 #include <signal.h>
+#include <string>
 
 class History;
 
@@ -13,21 +14,41 @@ class Terminal {
 
 		bool	is_done();
 		int	get_terminal_fd() { return terminal_fd; }
+		int	get_signal_fd() { return signal_fd; }
 		void	tick();
+		void	signal_received();
+			// Call when get_signal_fd() is readable.
 		void	send(const char* data, int length = -1);
+		bool	has_output() { return outgoing_start < outgoing.size(); }
+		size_t	output_size() { return outgoing.size() - outgoing_start; }
+			// How much has been sent but not written to the child yet.
+		void	flush_output();
+			// Call when the terminal fd is writable and has_output() is true.
 		void	hang_up();
 		void	notify_resize(int columns, int rows, int pixel_width, int pixel_height);
 
 	private:
 		History* history;
 		int terminal_fd;
+		int	signal_fd;
 		pid_t child_pid;
 		char*	buffer;
 		int prebuffered_bytes;
-		static bool child_died;
+		bool	child_died;
+		bool	pty_closed;
+
+		// Output to the child is queued and written without blocking, as the
+		// child can take it.  (If we blocked, a child busy writing to us would
+		// never get around to reading, and we'd both be stuck.)  Big writes go
+		// out in chunks, so reading the child's output isn't held up by them.
+		std::string	outgoing;
+		std::string::size_type	outgoing_start;
+		enum {
+			max_write_size = 4096,
+			max_flush_size = 64 * 1024,
+			};
 
 		void	exec_shell();
-		static void	sigchld_received(int signal_number);
 	};
 
 
@@ -34,4 +34,41 @@ int UTF8::bytes_for_n_characters(const char* bytes, int length, int n)
 }
 
 
+uint32_t UTF8::decode(const char*& p, const char* end)
+{
+	static const uint32_t replacement_char = 0xFFFD;
+
+	unsigned char c = *p++;
+	if (c < 0x80)
+		return c;
+	int num_continuation_bytes = 0;
+	uint32_t result = replacement_char;
+	if (c >= 0xF0 && c < 0xF8) {
+		num_continuation_bytes = 3;
+		result = c & 0x07;
+		}
+	else if (c >= 0xE0 && c < 0xF0) {
+		num_continuation_bytes = 2;
+		result = c & 0x0F;
+		}
+	else if (c >= 0xC0 && c < 0xE0) {
+		num_continuation_bytes = 1;
+		result = c & 0x1F;
+		}
+	for (; num_continuation_bytes > 0; --num_continuation_bytes) {
+		if (p >= end || (*p & 0xC0) != 0x80)
+			return replacement_char;
+		result = (result << 6) | (*p++ & 0x3F);
+		}
+
+	// Like num_characters(), treat any extra continuation bytes as part of this
+	// character.
+	while (p < end && (*p & 0xC0) == 0x80) {
+		p += 1;
+		result = replacement_char;
+		}
+
+	return result;
+}
+
 
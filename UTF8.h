@@ -1,12 +1,18 @@
 #ifndef UTF8_h
 #define UTF8_h
 
+#include <stdint.h>
+
 
 class UTF8 {
 	public:
 		// These assume that the bytes are valid UTF8.
 		static int	num_characters(const char* bytes, int length);
 		static int	bytes_for_n_characters(const char* bytes, int length, int n);
+
+		// Returns the character at "p" and advances "p" past it.  Unlike the
+		// others, this one copes with invalid UTF8 (returning U+FFFD for it).
+		static uint32_t	decode(const char*& p, const char* end);
 	};
 
 